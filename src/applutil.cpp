@@ -22,7 +22,6 @@
 #include <fstream>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string/regex.hpp>
-#include <boost/chrono.hpp>
 #include <boost/process.hpp>
 #include <boost/iostreams/stream.hpp>
 
@@ -44,7 +43,6 @@ std::string info(const boost::asio::ip::tcp::socket& s)
 
 namespace uniproxy
 {
-std::mutex log_mutex;
 
 std::string replace(const std::string& source, const std::string& what, const std::string& with)
 {
@@ -306,6 +304,22 @@ bool is_connected( ip::tcp::socket::lowest_layer_type &_socket )
 }
 
 
+bool get_certificate_common_name( boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &_socket, std::string &_common_name )
+{
+   bool result = false;
+   if (X509* cert = SSL_get_peer_certificate( _socket.native_handle()))
+   {
+      if (SSL_get_verify_result(_socket.native_handle()) == X509_V_OK)
+      {
+         _common_name = get_common_name( X509_get_issuer_name(cert) );
+         result = true;
+      }
+      X509_free( cert );
+   }
+   return result;
+}
+
+
 bool get_certificate_issuer_subject( boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &_socket, std::string &_issuer, std::string &_subject )
 {
    bool result = false;
@@ -351,46 +365,42 @@ bool equal(const certificate_type &_cert1, const certificate_type &_cert2)
 }
 
 
-std::string get_common_name( const certificate_type &_cert )
+std::string get_common_name( X509_NAME *_name )
 {
-   std::string common_name, issuer = get_issuer_name( _cert );
-   if ( issuer.length() > 0 )
+   std::string common_name;
+   int index = _name ? X509_NAME_get_index_by_NID( _name, NID_commonName, -1 ) : -1;
+   if ( index >= 0 )
    {
-      std::vector< std::string > result;
-      boost::algorithm::split_regex( result, issuer, boost::regex( "/CN=" ) );
-      if ( result.size() > 1 )
-      {
-         common_name = result[1];
-      }
+      ASN1_STRING *data = X509_NAME_ENTRY_get_data( X509_NAME_get_entry( _name, index ) );
+      common_name.assign( (const char*)ASN1_STRING_get0_data( data ), ASN1_STRING_length( data ) );
    }
    return common_name;
 }
 
 
-bool delete_certificate_file( const std::string &_filename, const std::string &_name )
+std::string get_common_name( const certificate_type &_cert )
+{
+   return get_common_name( X509_get_issuer_name( _cert.get() ) );
+}
+
+
+std::string get_key_type( const certificate_type &_cert )
 {
-   std::vector<certificate_type> local_certs;
-   if ( load_certificates_file( my_certs_name, local_certs ) )
+   EVP_PKEY *key = X509_get0_pubkey( _cert.get() );
+   if ( key == nullptr )
    {
-      bool hit;
-      do
-      {
-         hit = false;
-         for ( auto iter = local_certs.begin(); iter != local_certs.end(); iter++ )
-         {
-            if ( _name == get_common_name( *iter ) )
-            {
-               DOUT("Deleting certificate: " << _name);
-               hit = true;
-               local_certs.erase(iter);
-               break;
-            }
-         }
-      }
-      while( hit );
-      return save_certificates_file( my_certs_name, local_certs );
+      return std::string();
    }
-   return false;
+   switch ( EVP_PKEY_base_id( key ) )
+   {
+   case EVP_PKEY_RSA:
+      return "rsa" + mylib::to_string( EVP_PKEY_bits( key ) );
+   case EVP_PKEY_EC:
+      return EVP_PKEY_bits( key ) == 256 ? "ec-p256" : "ec" + mylib::to_string( EVP_PKEY_bits( key ) );
+   case EVP_PKEY_ED25519:
+      return "ed25519";
+   }
+   return OBJ_nid2sn( EVP_PKEY_base_id( key ) );
 }
 
 
@@ -533,6 +543,26 @@ proxy_log::proxy_log(const std::string&_name)
    this->m_log_file_index = 0;
    this->m_write_index = 0;
    this->m_name = _name;
+   this->m_log.resize(50);
+}
+
+
+void proxy_log::set_capacity( size_t _capacity )
+{
+   std::lock_guard<std::mutex> l(this->m_mutex);
+   _capacity = std::max<size_t>(_capacity, 1);
+   if (_capacity == this->m_log.size())
+   {
+      return;
+   }
+   std::vector<std::string> log(_capacity);
+   const int write_index = this->m_write_index;
+   this->m_first_index = std::max(this->m_first_index, write_index - (int)_capacity);
+   for (int index = this->m_first_index; index < write_index; index++)
+   {
+      log[index % _capacity] = std::move(this->m_log[index % this->m_log.size()]);
+   }
+   this->m_log.swap(log);
 }
 
 
@@ -540,9 +570,9 @@ std::string proxy_log::peek() const
 {
    std::lock_guard<std::mutex> l(this->m_mutex);
    std::string sz;
-   if ( this->m_log.size() > 0)
+   if ( this->m_write_index > 0)
    {
-      sz = this->m_log.back().second;
+      sz = this->m_log[(this->m_write_index - 1) % this->m_log.size()];
    }
    return sz;
 }
@@ -552,8 +582,25 @@ std::string proxy_log::get(int index) const
 {
    std::lock_guard<std::mutex> l(this->m_mutex);
    std::string sz;
-   auto iter = std::find_if(this->m_log.begin(),this->m_log.end(), [&](const std::pair<int,std::string> &_){return _.first == index;});
-   if (iter != this->m_log.end()) return iter->second;
+   if (index >= this->m_first_index && index < this->m_write_index)
+   {
+      sz = this->m_log[index % this->m_log.size()];
+   }
+   return sz;
+}
+
+
+std::string proxy_log::get_since(int &_index) const
+{
+   std::lock_guard<std::mutex> l(this->m_mutex);
+   std::string sz;
+   const int write_index = this->m_write_index;
+   for (int index = std::max(_index, this->m_first_index); index < write_index; index++)
+   {
+      sz += this->m_log[index % this->m_log.size()];
+      sz += '\n';
+   }
+   _index = write_index;
    return sz;
 }
 
@@ -593,11 +640,9 @@ void proxy_log::add( const std::string &_value )
       this->m_log_file_index = i0;
       this->m_logfile.open(this->filename(this->m_log_file_index));
    }
-   this->m_log.push_back(std::make_pair(this->m_write_index++, mylib::time_stamp() + ": " + _value));
-   while (this->m_log.size() > 50)
-   {
-      this->m_log.erase(this->m_log.begin());
-   }
+   this->m_log[this->m_write_index % this->m_log.size()] = mylib::time_stamp() + ": " + _value;
+   this->m_write_index++;
+   this->m_first_index = std::max(this->m_first_index, this->m_write_index - (int)this->m_log.size());
   #ifdef _SYSTEMD_
    do_log(_value);
   #endif
@@ -623,83 +668,217 @@ void proxy_log::do_log(const std::string& s)
 #endif
 
 
-int64_t data_flow::timestamp() const
+coarse_clock::coarse_clock()
+:  m_seconds(now())
 {
-   auto time = boost::chrono::steady_clock::now();       // get the current time
-   auto since_epoch = time.time_since_epoch();     // get the duration since epoch
-   boost::chrono::seconds secs = boost::chrono::duration_cast<boost::chrono::seconds>(since_epoch);
-   return secs.count();
+   this->m_thread = std::thread([this]
+   {
+      while (!this->m_stop)
+      {
+         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+         this->m_seconds.store(now(), std::memory_order_relaxed);
+      }
+   });
 }
 
 
-data_flow::data_flow( bool _debug )
+coarse_clock::~coarse_clock()
 {
-   std::lock_guard<std::mutex> l(this->m_mutex);
-   this->m_debug = _debug;
-   for (int index = 0; index < data_flow_size; index++)
+   this->m_stop = true;
+   if (this->m_thread.joinable())
    {
-      m_buffer[index] = 0;
+      this->m_thread.join();
    }
-   this->m_stamp = this->timestamp();
+}
+
+
+coarse_clock &coarse_clock::instance()
+{
+   static coarse_clock clock;
+   return clock;
+}
+
+
+int64_t coarse_clock::now()
+{
+   return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+data_flow::data_flow( bool _debug )
+:  m_debug(_debug)
+{
 }
 
 
 void data_flow::clear()
 {
-   std::lock_guard<std::mutex> l(this->m_mutex);
-   for (int index = 0; index < data_flow_size; index++)
+   for (auto &item : this->m_slots)
    {
-      this->m_buffer[index] = 0;
+      item.stamp.store(-1, std::memory_order_relaxed);
+      item.bytes.store(0, std::memory_order_relaxed);
+      item.ops.store(0, std::memory_order_relaxed);
    }
 }
 
 
-void data_flow::cleanup( int64_t _stamp )
+void data_flow::add( size_t _count )
 {
-   if ( _stamp >= this->m_stamp + data_flow_size )
+   const int64_t stamp = coarse_clock::seconds();
+   slot &item = this->m_slots[stamp % slots];
+   int64_t old = item.stamp.load(std::memory_order_relaxed);
+   if (old != stamp && item.stamp.compare_exchange_strong(old, stamp, std::memory_order_relaxed))
    {
-      for (int index = 0; index < data_flow_size; index++)
-      {
-         this->m_buffer[index] = 0;
-      }
+      item.bytes.store(0, std::memory_order_relaxed);
+      item.ops.store(0, std::memory_order_relaxed);
    }
-   else
+   item.bytes.fetch_add(_count, std::memory_order_relaxed);
+   item.ops.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+size_t data_flow::sum( int _from, int _to, bool _ops ) const
+{
+   const int64_t stamp = coarse_clock::seconds();
+   size_t value = 0;
+   // Shortly after boot the clock has not counted that far back yet.
+   for (int back = _from; back <= _to && back <= stamp; back++)
    {
-      int index = this->m_stamp % data_flow_size;
-      int index_stop = _stamp % data_flow_size;
-      while ( index != index_stop )
+      const slot &item = this->m_slots[(stamp - back) % slots];
+      if (item.stamp.load(std::memory_order_relaxed) == stamp - back)
       {
-         index = (index + 1) % data_flow_size;
-         this->m_buffer[index] = 0;
+         value += (_ops ? item.ops : item.bytes).load(std::memory_order_relaxed);
       }
    }
+   return value;
 }
 
 
-void data_flow::add( size_t _count )
+size_t data_flow::get() const
 {
-   std::lock_guard<std::mutex> l(this->m_mutex);
-   int64_t stamp = this->timestamp();
-   this->cleanup(stamp);
-   this->m_buffer[ stamp % data_flow_size ] += _count;
-   this->m_stamp = stamp;
+   return this->sum(0, period - 1, false);
 }
 
 
-size_t data_flow::get()
+size_t data_flow::get_ops() const
+{
+   return this->sum(0, period - 1, true);
+}
+
+
+double data_flow::rate( int _seconds ) const
+{
+   _seconds = std::min(std::max(_seconds, 1), (int)period);
+   return (double)this->sum(1, _seconds, false) / _seconds;
+}
+
+
+size_t data_flow::peak() const
 {
-   std::lock_guard<std::mutex> l(this->m_mutex);
-   int64_t stamp = this->timestamp();
-   this->cleanup(stamp);
    size_t value = 0;
-   for (int index = 0; index < data_flow_size; index++)
+   for (int back = 1; back <= period; back++)
    {
-      value += this->m_buffer[index];
+      value = std::max(value, this->sum(back, back, false));
    }
    return value;
 }
 
 
+cppcms::json::value data_flow::save_json_rates() const
+{
+   cppcms::json::value obj;
+   obj["1s"] = (int)this->rate(1);
+   obj["10s"] = (int)this->rate(10);
+   obj["60s"] = (int)this->rate(60);
+   obj["peak"] = (int)this->peak();
+   return obj;
+}
+
+
+read_buffer::read_buffer( size_t _size, bool _adaptive )
+{
+   this->configure( _size, _adaptive );
+}
+
+
+void read_buffer::configure( size_t _size, bool _adaptive )
+{
+   ASSERTE( _size > 0, uniproxy::error::parse_file_failed, "Invalid read buffer size" );
+   this->m_size = this->m_min_size = _size;
+   this->m_adaptive = _adaptive;
+   this->m_light_reads = 0;
+   // Allocate for the largest size up front, so the data does not move when the size changes.
+   this->m_data.assign( (_adaptive ? std::max( _size, (size_t)tls_record_size ) : _size) + 1, 0 );
+}
+
+
+void read_buffer::update( size_t _bytes_transferred )
+{
+   if ( !this->m_adaptive )
+   {
+      return;
+   }
+   if ( _bytes_transferred >= this->m_size )
+   {
+      this->m_size = std::min( this->m_size * 2, this->m_data.size() - 1 );
+      this->m_light_reads = 0;
+   }
+   else if ( _bytes_transferred < this->m_size / 4 && this->m_size > this->m_min_size )
+   {
+      // Shrink slowly, a single short read is normal at the end of a burst.
+      if ( ++this->m_light_reads >= 16 )
+      {
+         this->m_size = std::max( this->m_size / 2, this->m_min_size );
+         this->m_light_reads = 0;
+      }
+   }
+   else
+   {
+      this->m_light_reads = 0;
+   }
+}
+
+
+void write_coalescer::configure( size_t _size, int _delay_ms )
+{
+   this->m_size = _size;
+   this->m_delay_ms = std::max( _delay_ms, 0 );
+   this->m_pending.reserve( this->m_size );
+   this->m_writing_data.reserve( this->m_size );
+}
+
+
+void write_coalescer::load_json( const cppcms::json::value &_json )
+{
+   int size = cppcms::utils::check_int( _json, "coalesce_size", (int)this->m_size, false );
+   int delay = cppcms::utils::check_int( _json, "coalesce_delay", this->m_delay_ms, false );
+   this->configure( std::max( size, 0 ), delay );
+}
+
+
+boost::asio::const_buffer write_coalescer::take()
+{
+   this->m_writing_data.swap( this->m_pending ); // Swap rather than copy, both keep their capacity.
+   this->m_pending.clear();
+   this->m_writing = true;
+   return boost::asio::buffer( this->m_writing_data );
+}
+
+
+void write_coalescer::written()
+{
+   this->m_writing_data.clear();
+   this->m_writing = false;
+}
+
+
+void write_coalescer::reset()
+{
+   this->m_pending.clear();
+   this->written();
+}
+
+
 const char* uniproxy::category_impl::name() const noexcept
 {
    return "uniproxy";
@@ -870,6 +1049,7 @@ bool LocalEndpoint::load(cppcms::json::value &obj)
    {
       cppcms::utils::check_port(obj,"port",this->m_port);
       cppcms::utils::check_string(obj,"hostname",this->m_hostname);
+      cppcms::utils::check_int(obj,"weight",this->m_weight);
       return this->m_port > 0; // At least a valid port must be configured. Default hostname is localhost.
    }
    return false;
@@ -881,13 +1061,17 @@ cppcms::json::value LocalEndpoint::save() const
    cppcms::json::value obj;
    cppcms::utils::set_value(obj,"port",this->m_port);
    cppcms::utils::set_value(obj,"hostname",this->m_hostname);
+   if (this->m_weight != 1)
+   {
+      obj["weight"] = this->m_weight;
+   }
    return obj;
 }
 
 
 bool operator == (const LocalEndpoint &a1, const LocalEndpoint &a2)
 {
-   return a1.m_hostname == a2.m_hostname && a1.m_port == a2.m_port;
+   return a1.m_hostname == a2.m_hostname && a1.m_port == a2.m_port && a1.m_weight == a2.m_weight;
 }
 
 
@@ -23,6 +23,7 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include "platform.h"
+#include "async_log.h"
 #include <boost/date_time/posix_time/posix_time.hpp>  // ptime
 #include <boost/thread/thread_time.hpp>               // get_system_time
 #include <boost/asio.hpp>
@@ -33,13 +34,10 @@
 #include <chrono>
 #include <atomic>
 
-#ifdef _SYSTEMD_
-#define DOUT( xx ) { std::lock_guard<std::mutex> lock(uniproxy::log_mutex); std::ostringstream oss; oss << mylib::time_stamp() << " id:"  << uniproxy::mask(std::this_thread::get_id()) << " " << uniproxy::filename(__FILE__) << " " << __FUNCTION__ << ":" << __LINE__ << " " << xx; proxy_log::do_log(oss.str()); }
-#define DERR( xx ) { std::lock_guard<std::mutex> lock(uniproxy::log_mutex); std::ostringstream oss; oss << mylib::time_stamp() << " id:"  << uniproxy::mask(std::this_thread::get_id()) << " " << uniproxy::filename(__FILE__) << " " << __FUNCTION__ << ":" << __LINE__ << " " << xx; proxy_log::do_log(oss.str()); }
-#else
-#define DOUT( xx ) { std::lock_guard<std::mutex> lock(uniproxy::log_mutex); mylib::dout() << mylib::time_stamp() << " id:"  << uniproxy::mask(std::this_thread::get_id()) << " " << uniproxy::filename(__FILE__) << " " << __FUNCTION__ << ":" << __LINE__ << " " << xx << std::endl; }
-#define DERR( xx ) { std::lock_guard<std::mutex> lock(uniproxy::log_mutex); mylib::derr() << mylib::time_stamp() << " id:"  << uniproxy::mask(std::this_thread::get_id()) << " " << uniproxy::filename(__FILE__) << " " << __FUNCTION__ << ":" << __LINE__ << " " << xx << std::endl; }
-#endif
+// The message is only formatted when the level is enabled and the statement is not rate limited.
+#define DLOG( level, xx ) { static uniproxy::log_site log_site_( level ); if ( log_site_.enabled() && log_site_.allow() ) { std::ostringstream log_stream_; log_stream_ << xx; log_site_.write( __FILE__, __FUNCTION__, __LINE__, log_stream_.str() ); } }
+#define DOUT( xx ) DLOG( uniproxy::log_level::debug, xx )
+#define DERR( xx ) DLOG( uniproxy::log_level::error, xx )
 #define COUT( xx ) { std::cout << xx << std::endl; }
 
 #define ASSERTD( xx, yy ) { if ( !(xx) ) throw std::runtime_error( yy ); };
@@ -53,8 +51,6 @@ std::string info(const boost::asio::ip::tcp::socket& s);
 
 namespace uniproxy
 {
-extern std::mutex log_mutex;
-
 std::string mask(std::thread::id);
 std::string filename(const std::string &_filepath);
 
@@ -269,6 +265,8 @@ void socket_connect( ip::tcp::socket::lowest_layer_type &_socket, boost::asio::i
 bool is_connected( ip::tcp::socket::lowest_layer_type &_socket );
 
 bool get_certificate_issuer_subject( boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &_socket, std::string &_issuer, std::string &_subject );
+// The issuer CN of the verified peer certificate. The certificates are self signed, so it is also the subject CN.
+bool get_certificate_common_name( boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &_socket, std::string &_common_name );
 
 // This function will perform a read_some on a blocking socket. Notice it uses a thread, so it is slow.
 // Notice this functionality is not supported by ASIO in itself.
@@ -330,8 +328,34 @@ typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
 const std::string my_public_cert_name = "my_public_cert.pem";
 const std::string my_private_key_name = "my_private_key.pem";
 const std::string my_certs_name = "certs.pem";
+const std::string my_ticket_key_name = "my_ticket_key.bin"; // Generated, and replaced when older than a day.
 const std::string config_filename = "uniproxy.json";
 
+// A steady clock with a resolution of a second, for stamping in the hot paths without a system call.
+// It is read with a relaxed atomic load and updated by a background thread every 100 ms.
+class coarse_clock
+{
+public:
+
+   static int64_t seconds() { return instance().m_seconds.load(std::memory_order_relaxed); }
+
+private:
+
+   coarse_clock();
+   ~coarse_clock();
+   static coarse_clock &instance();
+   static int64_t now();
+
+   std::atomic<int64_t> m_seconds;
+   std::atomic<bool> m_stop{false};
+   std::thread m_thread;
+};
+
+
+// Bytes and operations per second for the last minute, for one session and direction.
+// The writer only does relaxed atomic adds to the slot of the current second of the coarse clock, the sums, rates
+// and peaks are computed when read. A slot is claimed for a new second by the first add, an add racing with the
+// claim may be lost.
 class data_flow
 {
 public:
@@ -340,36 +364,128 @@ public:
    
    void add( size_t _count );
    
-   size_t get();
+   // The bytes in the last 60 seconds, including the current one.
+   size_t get() const;
+
+   // The number of add calls, i.e. the number of reads or writes, in the same period as get.
+   size_t get_ops() const;
+
+   // Bytes per second over the last _seconds completed seconds, up to 60.
+   double rate( int _seconds ) const;
+
+   // The most bytes in one of the last 60 completed seconds.
+   size_t peak() const;
+
+   // The rates for 1, 10 and 60 seconds and the peak.
+   cppcms::json::value save_json_rates() const;
 
    void clear();
 
 private:
 
-   void cleanup( int64_t _stamp );
+   enum { slots = 64, period = 60 };
 
-   #define data_flow_size 60
-   
-   // Modulate by 1 seconds.
-   size_t m_buffer[data_flow_size];
+   struct slot
+   {
+      std::atomic<int64_t> stamp{-1}; // The second counted.
+      std::atomic<size_t> bytes{0};
+      std::atomic<size_t> ops{0};
+   };
 
-   int64_t timestamp() const;
+   // The sum of the slots from _from to _to seconds back, 0 being the current second.
+   size_t sum( int _from, int _to, bool _ops ) const;
 
-   int64_t m_stamp;
+   slot m_slots[slots];
 
    bool m_debug;
+};
 
-   mutable std::mutex m_mutex;
 
+// A buffer for socket reads.
+// In adaptive mode the size used for a read doubles while the reads fill it, up to a full TLS record,
+// and is halved again when the reads use less than a quarter of it for a while, down to the configured size.
+class read_buffer
+{
+public:
+
+   enum { default_size = 1024, tls_record_size = 16384 };
+
+   read_buffer( size_t _size = default_size, bool _adaptive = false );
+
+   // NB!! Must not be called while a read is pending.
+   void configure( size_t _size, bool _adaptive );
+
+   // Call with the result of every read. The data is left untouched.
+   void update( size_t _bytes_transferred );
+
+   char *data() { return this->m_data.data(); }
+   const char *data() const { return this->m_data.data(); }
+   size_t size() const { return this->m_size; }
+   size_t min_size() const { return this->m_min_size; }
+   bool adaptive() const { return this->m_adaptive; }
+
+   // There is always room for a 0 termination after the data read.
+   boost::asio::mutable_buffer buffer() { return boost::asio::buffer( this->m_data.data(), this->m_size ); }
+
+private:
+
+   std::vector<char> m_data;
+   size_t m_size;
+   size_t m_min_size;
+   bool m_adaptive;
+   int m_light_reads = 0;
 };
 
 
+// Gathers small pieces of data for a stream into larger writes, i.e. fewer and fuller TLS records.
+// The pending data is written once "coalesce_size" bytes are pending or "coalesce_delay" ms has passed.
+// A size of 0 disables it, everything is then written as soon as possible.
+// Data is gathered into a single buffer, since the SSL stream makes a record for each buffer in a sequence.
+class write_coalescer
+{
+public:
+
+   void configure( size_t _size, int _delay_ms );
+
+   // "coalesce_size" and "coalesce_delay" from a host or client configuration.
+   void load_json( const cppcms::json::value &_json );
+
+   bool enabled() const { return this->m_size > 0; }
+   size_t limit() const { return this->m_size; }
+   int delay_ms() const { return this->m_delay_ms; }
+   boost::posix_time::time_duration delay() const { return boost::posix_time::milliseconds( this->m_delay_ms ); }
+
+   void append( const char *_data, size_t _size ) { this->m_pending.append( _data, _size ); }
+   size_t pending() const { return this->m_pending.size(); }
+   const std::string &pending_data() const { return this->m_pending; }
+   bool full() const { return this->m_pending.size() >= this->m_size; }
+   bool writing() const { return this->m_writing; }
+
+   // Start a write of everything pending. The buffer is valid until written or reset is called.
+   boost::asio::const_buffer take();
+   void written();
+   void reset();
+
+private:
+
+   size_t m_size = 8192;
+   int m_delay_ms = 2;
+   std::string m_pending;
+   std::string m_writing_data;
+   bool m_writing = false;
+};
+
+
+// The last "log_history" lines, in a ring indexed by their sequence number.
 class proxy_log
 {
 public:
 
    proxy_log( const std::string &_name );
 
+   // The oldest lines are dropped if the capacity shrinks.
+   void set_capacity( size_t _capacity );
+
    void add( const std::string &_value );
 
 #ifdef _SYSTEMD_
@@ -383,6 +499,10 @@ public:
 
    std::string get(int _index) const;
 
+   // The lines from sequence number _index on that are still kept, each terminated by a newline.
+   // _index is set to the sequence number of the next line.
+   std::string get_since(int &_index) const;
+
    size_t count() const;
 
    static std::string filename(int index);
@@ -391,7 +511,8 @@ public:
 
 protected:
 
-   std::vector<std::pair<int,std::string>> m_log;
+   std::vector<std::string> m_log; // The line with sequence number n is at n % size.
+   int m_first_index = 0; // The oldest line kept.
 
    mutable std::mutex m_mutex;
    std::string m_name;
@@ -426,6 +547,7 @@ public:
 
    std::string m_hostname;
    mylib::port_type m_port;
+   int m_weight = 1; // For the weighted balance policy.
 
 };
 
@@ -471,8 +593,8 @@ public:
       if ( this->m_size > 0 )
       {
          this->m_buffer = new char[this->m_size+1];
-         memset( this->m_buffer, 0, this->m_size+1);     // Just add a 0 termination to enable string output
          memcpy( this->m_buffer, _buffer, this->m_size );
+         ((char*)this->m_buffer)[this->m_size] = 0;     // Just add a 0 termination to enable string output
       }
    }
 
@@ -487,6 +609,39 @@ public:
 };
 
 
+// A view of the data just read from a socket, used by the plugin filters.
+// The data can be inspected in place. A filter rewriting the payload calls assign, which is the only allocation.
+class BufferView
+{
+public:
+
+   BufferView( const void * _data, size_t _size ) : m_data((const char*)_data), m_size(_size)
+   {
+   }
+
+   const char *data() const { return this->m_data; }
+   size_t size() const { return this->m_size; }
+
+   void assign( const void * _data, size_t _size )
+   {
+      this->m_rewritten = std::make_shared<std::string>( (const char*)_data, _size );
+      this->m_data = this->m_rewritten->data();
+      this->m_size = this->m_rewritten->size();
+   }
+
+   // Set if the payload was rewritten. Keep it alive while an async write of buffer() is in progress.
+   std::shared_ptr<const std::string> rewritten() const { return this->m_rewritten; }
+
+   boost::asio::const_buffer buffer() const { return boost::asio::buffer( this->m_data, this->m_size ); }
+
+protected:
+
+   const char *m_data;
+   size_t m_size;
+   std::shared_ptr<const std::string> m_rewritten;
+};
+
+
 class PluginHandler
 {
 public:
@@ -531,18 +686,61 @@ public:
    // This typically means that the remote is slow and/or congested.
    // If the full flag is set, then the function buffer the data and return false.
    // Once the full flag is cleared again we should start sending data again.
+   // The Buffer based filters operate on a copy of the data. Use the BufferView based filters below for new plugins.
+   // NB!! An override must not call these, they mark the plugin as not filtering.
    virtual bool message_filter_local2remote( Buffer &_buffer ) //, bool _full )
    {
+      this->m_passthrough_local2remote = true;
       return true;
    }
 
    virtual bool message_filter_remote2local( Buffer &_buffer ) //, bool _full )
    {
+      this->m_passthrough_remote2local = true;
       return true;
    }
 
+   // Inspect the data in place, call _view.assign() to rewrite it. Return false to discard the data.
+   // By default the Buffer based filters above are called.
+   virtual bool filter_local2remote( BufferView &_view )
+   {
+      return this->filter_legacy( _view, &PluginHandler::message_filter_local2remote );
+   }
+
+   virtual bool filter_remote2local( BufferView &_view )
+   {
+      return this->filter_legacy( _view, &PluginHandler::message_filter_remote2local );
+   }
+
+   // Used by the proxy. Once a filter is known not to be overridden by the plugin it is skipped altogether.
+   bool local2remote( BufferView &_view )
+   {
+      return this->m_passthrough_local2remote || this->filter_local2remote( _view );
+   }
+
+   bool remote2local( BufferView &_view )
+   {
+      return this->m_passthrough_remote2local || this->filter_remote2local( _view );
+   }
+
 private:
 
+   bool filter_legacy( BufferView &_view, bool (PluginHandler::*_filter)(Buffer &) )
+   {
+      Buffer buffer( (void*)_view.data(), _view.size() );
+      if ( !(this->*_filter)( buffer ) )
+      {
+         return false;
+      }
+      if ( buffer.m_size != _view.size() || memcmp( buffer.m_buffer, _view.data(), buffer.m_size ) != 0 )
+      {
+         _view.assign( buffer.m_buffer, buffer.m_size );
+      }
+      return true;
+   }
+
+   std::atomic<bool> m_passthrough_local2remote{false}, m_passthrough_remote2local{false};
+
    // If this was not defined as a * then it may be constructed at the wrong type. The basic = 0 seems to always work.
    static std::vector<PluginHandler*> *m_plugins;
 
@@ -562,11 +760,13 @@ typedef std::shared_ptr<X509> certificate_type;
 bool load_certificates_string( const std::string &_certificate_string, std::vector< certificate_type > &_certs );
 bool load_certificates_file( const std::string &_filename, std::vector< certificate_type > &_certs );
 bool save_certificates_file( const std::string &_filename, const std::vector<certificate_type> &_certs );
-bool delete_certificate_file( const std::string &_filename, const std::string &_name );
 
 std::string get_subject_name( const certificate_type &_cert );
 std::string get_issuer_name( const certificate_type &_cert );
 std::string get_common_name( const certificate_type &_cert );
+std::string get_common_name( X509_NAME *_name );
+// As config.key_type, e.g. "rsa3072" or "ec-p256".
+std::string get_key_type( const certificate_type &_cert );
 bool equal(const certificate_type &_cert1, const certificate_type &_cert2);
 
 
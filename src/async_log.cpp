@@ -0,0 +1,310 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "async_log.h"
+#include "applutil.h"
+#include "cppcms_util.h"
+#include "spsc_ring.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#ifdef _SYSTEMD_
+ #include <systemd/sd-journal.h>
+#endif
+
+namespace uniproxy
+{
+
+std::atomic<log_level> async_log::s_level{log_level::debug};
+std::atomic<int> async_log::s_rate_limit{100};
+
+namespace
+{
+
+// Per logging thread, and there may be one for each session. A record is typically around 150 bytes,
+// and the ring is drained every 50 ms.
+const size_t ring_size = 32 * 1024;
+const size_t ring_records = 512;
+
+// The ring of a logging thread. Kept until written, also when the thread has ended.
+// A record is the level as a digit, the text and a 0 termination.
+struct log_ring
+{
+   spsc_ring ring{ring_size, ring_records};
+   std::atomic<bool> done{false};
+   uint64_t lost = 0; // Reported, backend only.
+};
+
+
+class log_backend
+{
+public:
+
+   log_backend();
+
+   std::shared_ptr<log_ring> add_ring();
+   void set_file( const std::string &_filename );
+   void drain();
+
+private:
+
+   void output( log_level _level, const char *_text, size_t _size );
+
+   std::mutex m_mutex_rings;
+   std::vector<std::shared_ptr<log_ring>> m_rings;
+
+   std::mutex m_mutex_drain; // One writer at a time, the background thread or a flush.
+   std::string m_batch;
+   std::string m_filename;
+   std::ofstream m_file;
+};
+
+
+// Never deleted, so it is there for threads logging during exit.
+log_backend &backend()
+{
+   static log_backend *instance = []
+   {
+      log_backend *result = new log_backend();
+      std::atexit( []{ async_log::flush(); } );
+      return result;
+   }();
+   return *instance;
+}
+
+
+struct log_producer
+{
+   log_producer()
+   :  ring(backend().add_ring()),
+      id(mask(std::this_thread::get_id()))
+   {
+   }
+
+   ~log_producer()
+   {
+      this->ring->done = true;
+   }
+
+   // mylib::time_stamp, formatted once a second.
+   const std::string &time_stamp()
+   {
+      const std::time_t now = std::time(nullptr);
+      if ( now != this->stamp_time )
+      {
+         this->stamp_time = now;
+         this->stamp = mylib::time_stamp();
+      }
+      return this->stamp;
+   }
+
+   std::shared_ptr<log_ring> ring;
+   std::string id;
+   std::string record; // Reused.
+   std::time_t stamp_time = 0;
+   std::string stamp;
+};
+
+
+log_backend::log_backend()
+{
+   std::thread( [this]
+   {
+      for ( ; ; )
+      {
+         this->drain();
+         std::this_thread::sleep_for( std::chrono::milliseconds(50) );
+      }
+   }).detach();
+}
+
+
+std::shared_ptr<log_ring> log_backend::add_ring()
+{
+   auto result = std::make_shared<log_ring>();
+   std::lock_guard<std::mutex> lock(this->m_mutex_rings);
+   this->m_rings.push_back(result);
+   return result;
+}
+
+
+void log_backend::set_file( const std::string &_filename )
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex_drain);
+   if ( _filename == this->m_filename )
+   {
+      return;
+   }
+   this->m_filename = _filename;
+   this->m_file.close();
+   if ( !_filename.empty() )
+   {
+      this->m_file.open( _filename, std::ios::app );
+   }
+}
+
+
+void log_backend::output( log_level _level, const char *_text, size_t _size )
+{
+#ifdef _SYSTEMD_
+   if ( !this->m_file.is_open() )
+   {
+      sd_journal_send( "MESSAGE=%.*s", (int)_size, _text, "PRIORITY=%i", _level == log_level::error ? LOG_ERR : LOG_INFO, "GROUP=gatehouse", NULL );
+      return;
+   }
+#endif
+   this->m_batch.append( _text, _size );
+   this->m_batch += '\n';
+}
+
+
+void log_backend::drain()
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex_drain);
+   std::vector<std::shared_ptr<log_ring>> rings;
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex_rings);
+      rings = this->m_rings;
+   }
+   for ( auto &item : rings )
+   {
+      for ( ; ; )
+      {
+         spsc_ring::span span = item->ring.claim( ring_size );
+         if ( span.size == 0 )
+         {
+            break;
+         }
+         for ( const char *pos = span.data, *end = span.data + span.size; pos < end; )
+         {
+            const char *stop = (const char *)memchr( pos, 0, end - pos );
+            this->output( (log_level)(pos[0] - '0'), pos + 1, stop - pos - 1 );
+            pos = stop + 1;
+         }
+         item->ring.release( span );
+      }
+      const uint64_t lost = item->ring.overwritten() + item->ring.dropped();
+      if ( lost != item->lost )
+      {
+         const std::string text = mylib::time_stamp() + " Log records lost: " + std::to_string(lost - item->lost);
+         this->output( log_level::error, text.data(), text.size() );
+         item->lost = lost;
+      }
+   }
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex_rings);
+      this->m_rings.erase( std::remove_if( this->m_rings.begin(), this->m_rings.end(), [](const std::shared_ptr<log_ring> &_ring)
+      {
+         return _ring->done && _ring->ring.empty();
+      }), this->m_rings.end() );
+   }
+   if ( this->m_batch.empty() )
+   {
+      return;
+   }
+   if ( this->m_file.is_open() )
+   {
+      this->m_file.write( this->m_batch.data(), this->m_batch.size() );
+      this->m_file.flush();
+   }
+   else
+   {
+      fwrite( this->m_batch.data(), 1, this->m_batch.size(), stdout );
+      fflush( stdout );
+   }
+   this->m_batch.clear();
+}
+
+} // namespace
+
+
+void async_log::write( log_level _level, const char *_file, const char *_function, int _line, const std::string &_message )
+{
+   thread_local log_producer producer;
+   std::string &record(producer.record);
+   record.clear();
+   record += (char)('0' + (int)_level);
+   record += producer.time_stamp();
+   record += " id:";
+   record += producer.id;
+   record += " ";
+   record += filename(_file);
+   record += " ";
+   record += _function;
+   record += ":";
+   record += std::to_string(_line);
+   record += " ";
+   record += _message;
+   std::replace( record.begin(), record.end(), '\0', ' ' );
+   record += '\0';
+   producer.ring->ring.push( record.data(), record.size() );
+}
+
+
+void async_log::load_json( const cppcms::json::value &_json )
+{
+   const std::string level = cppcms::utils::check_string( _json, "log_level", "debug", false );
+   ASSERTE( level == "debug" || level == "error" || level == "off", uniproxy::error::parse_file_failed, "Invalid log_level, must be debug, error or off is: " + level );
+   s_level = level == "debug" ? log_level::debug : level == "error" ? log_level::error : log_level::off;
+   s_rate_limit = std::max( 0, cppcms::utils::check_int( _json, "log_rate_limit", s_rate_limit, false ) );
+   backend().set_file( cppcms::utils::check_string( _json, "log_file", "", false ) );
+}
+
+
+void async_log::flush()
+{
+   backend().drain();
+}
+
+
+bool log_site::allow()
+{
+   const int limit = async_log::s_rate_limit.load(std::memory_order_relaxed);
+   if ( limit <= 0 )
+   {
+      return true;
+   }
+   const int64_t second = coarse_clock::seconds();
+   if ( this->m_second.load(std::memory_order_relaxed) != second )
+   {
+      this->m_second.store(second, std::memory_order_relaxed);
+      this->m_count.store(0, std::memory_order_relaxed);
+   }
+   if ( this->m_count.fetch_add(1, std::memory_order_relaxed) < limit )
+   {
+      return true;
+   }
+   this->m_suppressed.fetch_add(1, std::memory_order_relaxed);
+   return false;
+}
+
+
+void log_site::write( const char *_file, const char *_function, int _line, const std::string &_message )
+{
+   const uint64_t suppressed = this->m_suppressed.exchange(0, std::memory_order_relaxed);
+   if ( suppressed > 0 )
+   {
+      async_log::write( this->m_level, _file, _function, _line, _message + " (" + std::to_string(suppressed) + " similar suppressed)" );
+      return;
+   }
+   async_log::write( this->m_level, _file, _function, _line, _message );
+}
+
+}
@@ -0,0 +1,83 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _async_log_h
+#define _async_log_h
+
+#include "platform.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace uniproxy
+{
+
+// DOUT logs at debug, DERR at error.
+enum class log_level { debug, error, off };
+
+
+//
+// The backend of DOUT and DERR. A record is formatted by the logging thread into a ring of its own (spsc_ring),
+// and a background thread writes the records of all the rings in batches to stdout, the journal (_SYSTEMD_)
+// or the "log_file". A logging thread never waits for the output. When its ring is full the oldest records
+// are overwritten, and the number lost is logged.
+//
+class async_log
+{
+public:
+
+   static bool enabled( log_level _level ) { return _level >= s_level.load(std::memory_order_relaxed); }
+
+   static void write( log_level _level, const char *_file, const char *_function, int _line, const std::string &_message );
+
+   // "log_level", "log_file" and "log_rate_limit" from the "config" section.
+   static void load_json( const cppcms::json::value &_json );
+
+   // Writes the records logged so far. Also done at exit.
+   static void flush();
+
+   static std::atomic<log_level> s_level;
+   static std::atomic<int> s_rate_limit; // Records per second per statement, 0 for no limit.
+};
+
+
+//
+// One per DOUT or DERR statement. Lets up to "log_rate_limit" records a second through, the number suppressed
+// is added to the next record let through, e.g. for a repeated "Data overflow".
+//
+class log_site
+{
+public:
+
+   constexpr explicit log_site( log_level _level ) : m_level(_level) {}
+
+   bool enabled() const { return async_log::enabled(this->m_level); }
+   bool allow();
+   void write( const char *_file, const char *_function, int _line, const std::string &_message );
+
+private:
+
+   const log_level m_level;
+   std::atomic<int64_t> m_second{-1};
+   std::atomic<int> m_count{0};
+   std::atomic<uint64_t> m_suppressed{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,227 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "balancer.h"
+#include "cppcms_util.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+
+balance_policy balance_policy_from_string(const std::string &_name)
+{
+   if (_name == "least_connections")
+   {
+      return balance_policy::least_connections;
+   }
+   if (_name == "weighted")
+   {
+      return balance_policy::weighted;
+   }
+   if (_name == "hash")
+   {
+      return balance_policy::hash;
+   }
+   ASSERTE(_name.empty() || _name == "random", uniproxy::error::parse_file_failed, "Unknown balance policy: " + _name);
+   return balance_policy::random;
+}
+
+
+std::string to_string(balance_policy _policy)
+{
+   switch (_policy)
+   {
+      case balance_policy::least_connections: return "least_connections";
+      case balance_policy::weighted: return "weighted";
+      case balance_policy::hash: return "hash";
+      default: return "random";
+   }
+}
+
+
+void balancer::load_json(const cppcms::json::value &_json)
+{
+   this->m_policy = balance_policy_from_string(cppcms::utils::check_string(_json, "balance", "", false));
+   this->m_eject_failures = std::max(1, cppcms::utils::check_int(_json, "eject_failures", this->m_eject_failures, false));
+   this->m_eject_time = std::max(1, cppcms::utils::check_int(_json, "eject_time", this->m_eject_time, false));
+}
+
+
+void balancer::save_json_config(cppcms::json::object &_obj) const
+{
+   _obj["balance"] = to_string(this->m_policy);
+   _obj["eject_failures"] = this->m_eject_failures;
+   _obj["eject_time"] = this->m_eject_time;
+}
+
+
+void balancer::reset(const std::vector<LocalEndpoint> &_endpoints)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   this->m_states.clear();
+   for (auto &ep : _endpoints)
+   {
+      endpoint_state state;
+      state.name = ep.m_hostname + ":" + mylib::to_string(ep.m_port);
+      state.weight = ep.m_weight;
+      this->m_states.push_back(state);
+   }
+}
+
+
+bool balancer::ejected(const endpoint_state &_state, std::chrono::steady_clock::time_point _now) const
+{
+   return _state.failures >= this->m_eject_failures && _now < _state.ejected_until;
+}
+
+
+std::vector<int> balancer::order(const std::string &_name) const
+{
+   static thread_local std::mt19937 gen(std::random_device{}());
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   const auto now = std::chrono::steady_clock::now();
+   std::vector<int> indexes(this->m_states.size());
+   for (int index = 0; index < indexes.size(); index++)
+   {
+      indexes[index] = index;
+   }
+   std::shuffle(indexes.begin(), indexes.end(), gen);
+
+   // The lowest key first.
+   std::vector<double> keys(this->m_states.size(), 0);
+   for (int index = 0; index < keys.size(); index++)
+   {
+      const endpoint_state &state = this->m_states[index];
+      switch (this->m_policy)
+      {
+         case balance_policy::least_connections:
+            keys[index] = state.active;
+            break;
+         case balance_policy::weighted:
+            // A weighted random order (Efraimidis-Spirakis), a weight of 0 is only used when the others fail.
+            keys[index] = state.weight > 0 ? -std::pow(std::uniform_real_distribution<>(0, 1)(gen), 1.0 / state.weight) : 1;
+            break;
+         case balance_policy::hash:
+            // Rendezvous hashing, only the remotes of a lost endpoint move.
+            keys[index] = -(double)std::hash<std::string>()(_name + "/" + state.name);
+            break;
+         default:
+            break;
+      }
+   }
+   std::stable_sort(indexes.begin(), indexes.end(), [&](int a, int b)
+   {
+      bool ejected_a = this->ejected(this->m_states[a], now), ejected_b = this->ejected(this->m_states[b], now);
+      if (ejected_a != ejected_b)
+      {
+         return ejected_b;
+      }
+      if (keys[a] != keys[b])
+      {
+         return keys[a] < keys[b];
+      }
+      return this->m_policy == balance_policy::least_connections && this->m_states[a].latency_ms < this->m_states[b].latency_ms;
+   });
+   return indexes;
+}
+
+
+bool balancer::available(int _index) const
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   return !this->ejected(this->m_states.at(_index), std::chrono::steady_clock::now());
+}
+
+
+void balancer::connected(int _index)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   endpoint_state &state = this->m_states.at(_index);
+   state.active++;
+   state.sessions++;
+}
+
+
+void balancer::fail(endpoint_state &_state)
+{
+   _state.failures++;
+   if (_state.failures >= this->m_eject_failures)
+   {
+      const int factor = 1 << std::min(_state.ejections, 4);
+      _state.ejected_until = std::chrono::steady_clock::now() + std::chrono::seconds(this->m_eject_time * factor);
+      _state.ejections++;
+      DERR("Ejecting local endpoint: " << _state.name << " failures: " << _state.failures << " for " << this->m_eject_time * factor << " seconds");
+   }
+}
+
+
+void balancer::failed(int _index)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   this->fail(this->m_states.at(_index));
+}
+
+
+void balancer::logon(int _index, bool _ok, std::chrono::milliseconds _latency)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   if (_index < 0) // The session was stopped meanwhile.
+   {
+      return;
+   }
+   endpoint_state &state = this->m_states.at(_index);
+   if (!_ok)
+   {
+      this->fail(state);
+      return;
+   }
+   if (state.failures >= this->m_eject_failures)
+   {
+      DOUT("Local endpoint back: " << state.name);
+   }
+   state.failures = 0;
+   state.ejections = 0;
+   state.latency_ms = state.latency_ms == 0 ? _latency.count() : 0.8 * state.latency_ms + 0.2 * _latency.count();
+}
+
+
+void balancer::released(int _index)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   endpoint_state &state = this->m_states.at(_index);
+   state.active = std::max(0, state.active - 1);
+}
+
+
+cppcms::json::value balancer::save_json_status(int _index) const
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   const endpoint_state &state = this->m_states.at(_index);
+   const auto now = std::chrono::steady_clock::now();
+   cppcms::json::value obj;
+   obj["active"] = state.active;
+   obj["sessions"] = state.sessions;
+   obj["failures"] = state.failures;
+   obj["logon_ms"] = (int)state.latency_ms;
+   obj["ejected"] = this->ejected(state, now);
+   if (this->ejected(state, now))
+   {
+      obj["ejected_seconds"] = (int)std::chrono::duration_cast<std::chrono::seconds>(state.ejected_until - now).count();
+   }
+   return obj;
+}
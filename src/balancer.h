@@ -0,0 +1,97 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _balancer_h
+#define _balancer_h
+
+#include "applutil.h"
+#include <chrono>
+
+
+// How a RemoteProxyHost picks the local endpoint for a new session. Selected per host with "balance".
+// random:            As before, a new random order for each session.
+// least_connections: The fewest active sessions first, ties broken by the logon latency.
+// weighted:          Random, in proportion to the "weight" of each of the "locals".
+// hash:              By the certificate name, so a remote sticks to the same local as long as it is healthy.
+enum class balance_policy { random, least_connections, weighted, hash };
+
+balance_policy balance_policy_from_string(const std::string &_name);
+std::string to_string(balance_policy _policy);
+
+
+//
+// Tracks the active sessions, the connect and logon failures and the logon latency of the local endpoints of a host.
+//
+// After "eject_failures" consecutive failures an endpoint is ejected for "eject_time" seconds, i.e. it is only tried
+// when all the others have failed. When the time is up, the next session probes it. A success brings it back,
+// a failure ejects it again for twice the time, up to 16 times "eject_time".
+//
+class balancer
+{
+public:
+
+   // "balance", "eject_failures" and "eject_time" from a host configuration.
+   void load_json(const cppcms::json::value &_json);
+   void save_json_config(cppcms::json::object &_obj) const;
+
+   void reset(const std::vector<LocalEndpoint> &_endpoints);
+
+   // The indexes of the endpoints in the order to attempt them for the remote with the certificate name.
+   std::vector<int> order(const std::string &_name) const;
+
+   // False while ejected.
+   bool available(int _index) const;
+
+   void connected(int _index);
+   void failed(int _index);
+   // The plugin logon on a connected endpoint. A failure also ends the session.
+   void logon(int _index, bool _ok, std::chrono::milliseconds _latency);
+   // The session on a connected endpoint ended.
+   void released(int _index);
+
+   cppcms::json::value save_json_status(int _index) const;
+
+   balance_policy policy() const { return this->m_policy; }
+   int eject_failures() const { return this->m_eject_failures; }
+   int eject_time() const { return this->m_eject_time; }
+
+private:
+
+   struct endpoint_state
+   {
+      std::string name;   // host:port
+      int weight = 1;
+      int active = 0;
+      int sessions = 0;
+      int failures = 0;   // Consecutive.
+      int ejections = 0;  // Consecutive.
+      double latency_ms = 0; // Moving average of the logon.
+      std::chrono::steady_clock::time_point ejected_until;
+   };
+
+   bool ejected(const endpoint_state &_state, std::chrono::steady_clock::time_point _now) const;
+   void fail(endpoint_state &_state);
+
+   balance_policy m_policy = balance_policy::random;
+   int m_eject_failures = 3;
+   int m_eject_time = 30; // Seconds
+   mutable std::mutex m_mutex;
+   std::vector<endpoint_state> m_states;
+};
+
+#endif
@@ -19,6 +19,7 @@
 #include "baseclient.h"
 #include <boost/bind.hpp>
 #include "proxy_global.h"
+#include "cppcms_util.h"
 
 static int static_local_id = 0;
 
@@ -61,6 +62,15 @@ void BaseClient::dolog( const std::string &_line )
 }
 
 
+void BaseClient::load_read_buffer(const cppcms::json::value &_json)
+{
+   this->m_read_buffer_size = std::max(1, cppcms::utils::check_int(_json, "read_buffer_size", max_length, false));
+   cppcms::utils::check_bool(_json, "read_buffer_adaptive", this->m_read_buffer_adaptive);
+   this->m_local_data.configure(this->m_read_buffer_size, this->m_read_buffer_adaptive);
+   this->m_remote_data.configure(this->m_read_buffer_size, this->m_read_buffer_adaptive);
+}
+
+
 const std::string BaseClient::dolog() const
 {
    return this->m_log;
@@ -79,6 +89,12 @@ std::string BaseClient::remote_hostname() const
 }
 
 
+const std::string &BaseClient::remote_name() const
+{
+   return this->m_proxy_endpoints[this->m_proxy_index].m_name;
+}
+
+
 bool BaseClient::is_remote_connected(int index) const
 {
    return this->mp_remote_socket != nullptr
@@ -192,6 +208,15 @@ bool BaseClient::certificate_exists(const std::string& certname) const
    return false;
 }
 
+void BaseClient::probe_targets(std::vector<health_monitor::target> &_targets) const
+{
+   for (auto &ep : this->m_proxy_endpoints)
+   {
+      _targets.push_back({ep.m_hostname, ep.m_port, "remote"});
+   }
+}
+
+
 cppcms::json::value BaseClient::save_json_status()
 {
    std::lock_guard<std::mutex> l(this->m_mutex_base);
@@ -237,13 +262,14 @@ cppcms::json::value BaseClient::save_json_status()
          {
             obj2["count_in"] = this->m_count_in.get();
             obj2["count_out"] = this->m_count_out.get();
+            obj2["ops_in"] = this->m_count_in.get_ops();
+            obj2["ops_out"] = this->m_count_out.get_ops();
+            obj2["rate_in"] = this->m_count_in.save_json_rates();
+            obj2["rate_out"] = this->m_count_out.save_json_rates();
          }
          obj["users"] = this->local_user_count();
       }
-      if (global.certificate_available(r.m_name))
-      {
-         obj2["cert"] = true;
-      }
+      global.save_json_certificate(obj2, r.m_name);
       if (this->m_proxy_index == index2 && this->m_activate_stamp > boost::get_system_time())
       {
          auto div = this->m_activate_stamp - boost::get_system_time();
@@ -263,5 +289,9 @@ cppcms::json::value BaseClient::save_json_config() const
    obj["remote_hostname"] = this->remote_hostname();
    obj["remote_port"] = this->remote_port();
    obj["max_connections"] = this->m_max_connections;
+   obj["read_buffer_size"] = this->m_read_buffer_size;
+   obj["read_buffer_adaptive"] = this->m_read_buffer_adaptive;
+   obj["coalesce_size"] = this->m_coalescer.limit();
+   obj["coalesce_delay"] = this->m_coalescer.delay_ms();
    return obj;
 }
@@ -20,6 +20,8 @@
 #define _baseclient_h
 
 #include "applutil.h"
+#include "health_monitor.h"
+#include "capture.h"
 
 typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
 
@@ -31,6 +33,8 @@ public:
 
    virtual cppcms::json::value save_json_status();
    virtual cppcms::json::value save_json_config() const;
+   // The endpoints for the health monitor to probe.
+   virtual void probe_targets(std::vector<health_monitor::target> &_targets) const;
 
    virtual void start() = 0;
    virtual void stop() = 0;
@@ -59,6 +63,8 @@ public:
 
    mylib::port_type activate_port() const { return this->m_activate_port; }
 
+   const write_coalescer &coalescer() const { return this->m_coalescer; }
+
 protected:
 
    virtual std::string info() const;
@@ -69,6 +75,7 @@ protected:
 
    // The remote connections does not need to be virtual.
    std::string remote_hostname() const;
+   const std::string &remote_name() const; // The certificate name.
    int remote_port() const;
    bool is_remote_connected(int index = -1) const;
 
@@ -99,9 +106,20 @@ protected:
    mylib::thread m_thread_activate;
    PluginHandler &m_plugin;
 
-   enum { max_length = 1024 };
-   char m_local_data[max_length+1];
-   char m_remote_data[max_length+1];
+   enum { max_length = read_buffer::default_size };
+   read_buffer m_local_data;
+   read_buffer m_remote_data;
+
+   // "read_buffer_size" and "read_buffer_adaptive" from the client configuration.
+   void load_read_buffer(const cppcms::json::value &_json);
+   size_t m_read_buffer_size = max_length;
+   bool m_read_buffer_adaptive = false;
+
+   // Gathers the local data for the remote.
+   write_coalescer m_coalescer;
+
+   // The capture writer of the remote, used by the thread reading.
+   capture::cache m_capture;
 
    // The following stuff must be protected by a mutex.
    mutable std::mutex m_mutex_base;
@@ -0,0 +1,289 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "capture.h"
+#include "proxy_global.h"
+#include "cppcms_util.h"
+#include <boost/filesystem.hpp>
+
+
+namespace
+{
+
+const size_t max_buffer = 16 * 1024 * 1024; // Per peer, beyond this the records are dropped.
+
+// The peer name is a certificate name, only the safe characters are used as is in the file name.
+// Otherwise a hash of the name is appended, so peers differing only in the other characters get files of their own.
+// FNV-1a, as the name must be the same after a restart.
+std::string capture_filename(const std::string &_peer)
+{
+   std::string name;
+   uint32_t hash = 2166136261u;
+   bool safe = true;
+   for (char c : _peer)
+   {
+      hash = (hash ^ (unsigned char)c) * 16777619u;
+      if (isalnum((unsigned char)c) || c == '-' || c == '.')
+      {
+         name += c;
+      }
+      else
+      {
+         name += '_';
+         safe = false;
+      }
+   }
+   if (!safe)
+   {
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "_%08x", hash);
+      name += suffix;
+   }
+   return global.m_log_path + "capture_" + name + ".bin";
+}
+
+}
+
+
+capture::capture()
+{
+}
+
+
+capture::~capture()
+{
+   this->m_thread.stop();
+}
+
+
+void capture::load_json(const cppcms::json::value &_json)
+{
+   this->m_file_size = std::max(1, cppcms::utils::check_int(_json, "capture_size", this->m_file_size, false));
+   this->m_files = std::max(1, cppcms::utils::check_int(_json, "capture_files", this->m_files, false));
+}
+
+
+void capture::enable_all(bool _enable)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   DOUT("Capture all: " << _enable);
+   this->m_all = _enable;
+   this->m_generation++;
+   this->update_active();
+}
+
+
+void capture::enable(const std::string &_peer, bool _enable)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   DOUT("Capture: " << _peer << " " << _enable);
+   if (_enable)
+   {
+      this->m_peers.insert(_peer);
+   }
+   else
+   {
+      this->m_peers.erase(_peer);
+   }
+   this->m_generation++;
+   this->update_active();
+}
+
+
+// With m_mutex.
+void capture::update_active()
+{
+   this->m_active = this->m_all || !this->m_peers.empty();
+   if (this->m_active && !this->m_thread.is_running())
+   {
+      this->m_thread.start([this]{ this->threadproc(); });
+   }
+}
+
+
+void capture::append(cache &_cache, const std::string &_peer, direction _direction, const char *_data, size_t _size)
+{
+   for (;;)
+   {
+      if (_cache.generation != this->m_generation.load(std::memory_order_acquire) || _cache.peer != _peer)
+      {
+         std::lock_guard<std::mutex> lock(this->m_mutex);
+         _cache.peer = _peer;
+         _cache.generation = this->m_generation;
+         _cache.item.reset();
+         if (this->m_all || this->m_peers.count(_peer) > 0)
+         {
+            std::shared_ptr<writer> &found = this->m_writers[_peer];
+            if (!found)
+            {
+               found = std::make_shared<writer>();
+               found->peer = _peer;
+               found->filename = capture_filename(_peer);
+            }
+            _cache.item = found;
+         }
+      }
+      if (!_cache.item)
+      {
+         return;
+      }
+      writer *item = _cache.item.get();
+      // Stamped under the lock, so the records of a peer are in time order in the file.
+      std::lock_guard<std::mutex> lock(item->mutex);
+      if (item->stopped)
+      {
+         // Removed by flush since we looked it up, its buffer is no longer written. Look up again.
+         _cache.generation = 0;
+         continue;
+      }
+      char header[capture_format::record_header_size];
+      capture_format::record_header(header, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count(), _direction, _size);
+      if (item->buffer.size() + sizeof(header) + _size > max_buffer)
+      {
+         item->dropped++;
+         return;
+      }
+      item->buffer.append(header, sizeof(header));
+      item->buffer.append(_data, _size);
+      item->records++;
+      item->bytes += _size;
+      return;
+   }
+}
+
+
+void capture::threadproc()
+{
+   DOUT(__FUNCTION__);
+   while (this->m_thread.check_run(false))
+   {
+      mylib::msleep(200);
+      this->flush();
+   }
+   this->flush();
+   DOUT(__FUNCTION__ << " stopped");
+}
+
+
+// Writes the buffers, and closes the files of the peers no longer captured.
+void capture::flush()
+{
+   std::vector<std::shared_ptr<writer>> writers, stopped;
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex);
+      for (auto iter = this->m_writers.begin(); iter != this->m_writers.end(); )
+      {
+         writers.push_back(iter->second);
+         if (!this->m_all && this->m_peers.count(iter->first) == 0)
+         {
+            // Nothing is appended after this, so the swap below writes the last of it.
+            std::lock_guard<std::mutex> item_lock(iter->second->mutex);
+            iter->second->stopped = true;
+            stopped.push_back(iter->second);
+            iter = this->m_writers.erase(iter);
+            continue;
+         }
+         ++iter;
+      }
+   }
+   for (auto &item : writers)
+   {
+      std::string data;
+      {
+         std::lock_guard<std::mutex> lock(item->mutex);
+         data.swap(item->buffer);
+      }
+      if (data.empty())
+      {
+         continue;
+      }
+      if (!item->file.is_open())
+      {
+         boost::system::error_code ec;
+         item->file_size = boost::filesystem::file_size(item->filename, ec);
+         item->file.open(item->filename, std::ios::binary | std::ios::app);
+         if (!item->file.is_open())
+         {
+            DERR("Failed to open capture file: " << item->filename);
+            continue;
+         }
+         if (ec || item->file_size == 0)
+         {
+            const std::string header = capture_format::file_header(item->peer);
+            item->file.write(header.data(), header.size());
+            item->file_size = header.size();
+         }
+      }
+      item->file.write(data.data(), data.size());
+      item->file.flush();
+      item->file_size += data.size();
+      if (item->file_size >= (uint64_t)this->m_file_size * 1024 * 1024)
+      {
+         this->rotate(*item);
+      }
+   }
+   for (auto &item : stopped)
+   {
+      item->file.close();
+   }
+}
+
+
+// capture_<peer>.bin becomes .1.bin, .1.bin becomes .2.bin and so on, the oldest is removed.
+void capture::rotate(writer &_writer)
+{
+   _writer.file.close();
+   _writer.file_size = 0;
+   const std::string base = _writer.filename.substr(0, _writer.filename.size() - 4);
+   auto name = [&](int index){ return index > 0 ? base + "." + mylib::to_string(index) + ".bin" : _writer.filename; };
+   boost::system::error_code ec;
+   boost::filesystem::remove(name(this->m_files - 1), ec);
+   for (int index = this->m_files - 1; index > 0; index--)
+   {
+      boost::filesystem::rename(name(index - 1), name(index), ec);
+   }
+   DOUT("Rotated capture file: " << _writer.filename);
+}
+
+
+cppcms::json::value capture::save_json_status() const
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   cppcms::json::value obj;
+   obj["all"] = this->m_all;
+   obj["peers"] = cppcms::json::array();
+   int index = 0;
+   for (auto &peer : this->m_peers)
+   {
+      obj["peers"][index++] = peer;
+   }
+   obj["files"] = cppcms::json::array();
+   index = 0;
+   for (auto &item : this->m_writers)
+   {
+      std::lock_guard<std::mutex> lock(item.second->mutex);
+      cppcms::json::value file;
+      file["peer"] = item.first;
+      file["filename"] = item.second->filename;
+      file["records"] = (double)item.second->records;
+      file["bytes"] = (double)item.second->bytes;
+      file["dropped"] = (double)item.second->dropped;
+      obj["files"][index++] = file;
+   }
+   return obj;
+}
@@ -0,0 +1,112 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _capture_h
+#define _capture_h
+
+#include "applutil.h"
+#include "capture_format.h"
+#include <map>
+#include <set>
+
+
+//
+// Captures the data read from and written to a peer, e.g. the certificate name of a remote, into
+// <log_path>capture_<peer>.bin. All peers are captured while enabled from /command/logfile, a single one
+// with /command/capture.
+//
+// The sessions append to a buffer per peer, a background thread writes the buffers every 200 ms.
+// A file is rotated at "capture_size" MB, and "capture_files" are kept: .bin, .1.bin, .2.bin ...
+// See capture_format.h for the file format, tools/replay.cpp plays a file back.
+//
+class capture
+{
+   struct writer;
+
+public:
+
+   typedef capture_format::direction direction;
+   static constexpr direction in = capture_format::in;
+   static constexpr direction out = capture_format::out;
+
+   capture();
+   ~capture();
+
+   // "capture_size" and "capture_files" from the "config" section.
+   void load_json(const cppcms::json::value &_json);
+
+   void enable_all(bool _enable);
+   void enable(const std::string &_peer, bool _enable);
+
+   // The writer of a peer as last looked up, kept by the caller. One per thread calling add.
+   // It is looked up again when the peer or the captured peers change.
+   class cache
+   {
+      friend class capture;
+      std::string peer;
+      uint64_t generation = 0;
+      std::shared_ptr<writer> item;
+   };
+
+   // Called with every read. Does nothing unless the peer is captured.
+   void add(cache &_cache, const std::string &_peer, direction _direction, const char *_data, size_t _size)
+   {
+      if (this->m_active.load(std::memory_order_relaxed))
+      {
+         this->append(_cache, _peer, _direction, _data, _size);
+      }
+   }
+
+   cppcms::json::value save_json_status() const;
+
+private:
+
+   struct writer
+   {
+      std::string peer;
+      std::string filename;
+      std::mutex mutex;      // For the buffer.
+      std::string buffer;
+      std::ofstream file;    // The flush thread only.
+      uint64_t file_size = 0;
+      uint64_t records = 0;
+      uint64_t bytes = 0;
+      uint64_t dropped = 0;  // Records dropped, the buffer was full.
+      bool stopped = false;  // Removed from m_writers, append looks up again.
+   };
+
+   void append(cache &_cache, const std::string &_peer, direction _direction, const char *_data, size_t _size);
+   void update_active();
+   void threadproc();
+   void flush();
+   void rotate(writer &_writer);
+
+   std::atomic<bool> m_active{false};
+   std::atomic<uint64_t> m_generation{1}; // Changed with m_all and m_peers.
+   std::atomic<int> m_file_size{64}; // MB
+   std::atomic<int> m_files{4};
+
+   mutable std::mutex m_mutex;
+   bool m_all = false;
+   std::set<std::string> m_peers;
+   std::map<std::string, std::shared_ptr<writer>> m_writers;
+
+   mylib::thread m_thread{nullptr};
+};
+
+#endif
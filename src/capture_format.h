@@ -0,0 +1,121 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _capture_format_h
+#define _capture_format_h
+
+// The capture file format, shared by the proxy and uniproxy-replay. No other dependencies.
+//
+// A file starts with a header:
+//    8 bytes  "UPXCAP01"
+//    uint16   size of the peer name
+//    the peer name, i.e. the certificate name (CN)
+// followed by the records:
+//    uint64   time, nanoseconds since 1970 UTC
+//    uint8    direction, 0 for data from the peer, 1 for data to it
+//    uint32   size
+//    the data
+// All little endian.
+
+#include <cstdint>
+#include <istream>
+#include <string>
+
+namespace capture_format
+{
+
+const char magic[] = "UPXCAP01";
+const size_t magic_size = 8;
+const size_t record_header_size = 13;
+
+enum direction : uint8_t { in = 0, out = 1 };
+
+struct record
+{
+   uint64_t time = 0; // Nanoseconds since 1970 UTC.
+   direction dir = in;
+   std::string data;
+};
+
+
+inline void put_le( char *_data, uint64_t _value, int _bytes )
+{
+   for ( int index = 0; index < _bytes; index++ )
+   {
+      _data[index] = (char)(_value >> (8 * index));
+   }
+}
+
+
+inline uint64_t get_le( const char *_data, int _bytes )
+{
+   uint64_t value = 0;
+   for ( int index = _bytes - 1; index >= 0; index-- )
+   {
+      value = (value << 8) | (unsigned char)_data[index];
+   }
+   return value;
+}
+
+
+inline std::string file_header( const std::string &_peer )
+{
+   char size[2];
+   put_le( size, _peer.size(), 2 );
+   return std::string( magic, magic_size ) + std::string( size, 2 ) + _peer.substr( 0, 0xffff );
+}
+
+
+inline void record_header( char *_header, uint64_t _time, direction _direction, size_t _size )
+{
+   put_le( _header, _time, 8 );
+   _header[8] = (char)_direction;
+   put_le( _header + 9, _size, 4 );
+}
+
+
+// False if not a capture file.
+inline bool read_file_header( std::istream &_is, std::string &_peer )
+{
+   char header[magic_size + 2];
+   if ( !_is.read( header, sizeof(header) ) || std::string( header, magic_size ) != std::string( magic, magic_size ) )
+   {
+      return false;
+   }
+   _peer.resize( get_le( header + magic_size, 2 ) );
+   return _peer.empty() || (bool)_is.read( &_peer[0], _peer.size() );
+}
+
+
+// False at the end of the file, or if the last record is incomplete.
+inline bool read_record( std::istream &_is, record &_record )
+{
+   char header[record_header_size];
+   if ( !_is.read( header, record_header_size ) )
+   {
+      return false;
+   }
+   _record.time = get_le( header, 8 );
+   _record.dir = (direction)header[8];
+   _record.data.resize( get_le( header + 9, 4 ) );
+   return _record.data.empty() || (bool)_is.read( &_record.data[0], _record.data.size() );
+}
+
+}
+
+#endif
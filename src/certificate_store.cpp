@@ -0,0 +1,178 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "certificate_store.h"
+#include <boost/filesystem.hpp>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <iomanip>
+
+
+certificate_store::certificate_store( const std::string &_filename )
+:  m_filename(_filename),
+   m_index(std::make_shared<index_type>())
+{
+}
+
+
+certificate_entry certificate_store::make_entry( const certificate_type &_cert )
+{
+   certificate_entry entry;
+   entry.cert = _cert;
+   entry.name = get_common_name( _cert );
+
+   unsigned char md[EVP_MAX_MD_SIZE];
+   unsigned int size = 0;
+   if ( X509_digest( _cert.get(), EVP_sha256(), md, &size ) == 1 )
+   {
+      std::ostringstream oss;
+      for ( unsigned int index = 0; index < size; index++ )
+      {
+         oss << std::hex << std::setw(2) << std::setfill('0') << (int)md[index];
+      }
+      entry.fingerprint = oss.str();
+   }
+
+   int days = 0, seconds = 0;
+   if ( ASN1_TIME_diff( &days, &seconds, nullptr, X509_get0_notAfter( _cert.get() ) ) == 1 )
+   {
+      entry.expires = std::chrono::system_clock::now() + std::chrono::hours(24 * days) + std::chrono::seconds(seconds);
+   }
+   return entry;
+}
+
+
+bool certificate_store::load()
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   std::vector<certificate_type> certs;
+   bool result = load_certificates_file( this->m_filename, certs );
+   auto index = std::make_shared<index_type>();
+   std::string names;
+   for ( auto &cert : certs )
+   {
+      certificate_entry entry = make_entry( cert );
+      names += "|" + entry.name;
+      (*index)[entry.name] = std::move(entry); // The last one with a name wins.
+   }
+   this->publish( index );
+   DOUT("Load certificates from file: " << names );
+   return result;
+}
+
+
+certificate_store::snapshot certificate_store::get() const
+{
+   return std::atomic_load( &this->m_index );
+}
+
+
+bool certificate_store::contains( const std::string &_name ) const
+{
+   snapshot index = this->get();
+   return index->find( _name ) != index->end();
+}
+
+
+std::shared_ptr<const certificate_entry> certificate_store::find( const std::string &_name ) const
+{
+   snapshot index = this->get();
+   auto it = index->find( _name );
+   if ( it == index->end() )
+   {
+      return nullptr;
+   }
+   return std::shared_ptr<const certificate_entry>( index, &it->second );
+}
+
+
+bool certificate_store::add( const certificate_type &_cert )
+{
+   return this->add( std::vector<certificate_type>{ _cert } );
+}
+
+
+bool certificate_store::add( const std::vector<certificate_type> &_certs )
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   std::shared_ptr<index_type> index;
+   for ( auto &cert : _certs )
+   {
+      certificate_entry entry = make_entry( cert );
+      const index_type &current = index ? *index : *this->m_index;
+      auto it = current.find( entry.name );
+      if ( it != current.end() && it->second.fingerprint == entry.fingerprint )
+      {
+         continue;
+      }
+      if ( !index )
+      {
+         index = std::make_shared<index_type>( *this->m_index );
+      }
+      DOUT((it == current.end() ? "Adding certificate: " : "Replacing certificate: ") << entry.name << " " << entry.fingerprint);
+      (*index)[entry.name] = std::move(entry);
+   }
+   if ( !index )
+   {
+      return false;
+   }
+   this->save( *index );
+   this->publish( index );
+   return true;
+}
+
+
+bool certificate_store::remove( const std::string &_name )
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   if ( this->m_index->count( _name ) == 0 )
+   {
+      return false;
+   }
+   auto index = std::make_shared<index_type>( *this->m_index );
+   index->erase( _name );
+   DOUT("Deleting certificate: " << _name);
+   this->save( *index );
+   this->publish( index );
+   return true;
+}
+
+
+// Sorted by name so the file does not change with the hashing.
+void certificate_store::save( const index_type &_index )
+{
+   std::map<std::string, certificate_type> sorted;
+   for ( auto &item : _index )
+   {
+      sorted[item.first] = item.second.cert;
+   }
+   std::vector<certificate_type> certs;
+   for ( auto &item : sorted )
+   {
+      certs.push_back( item.second );
+   }
+   const std::string tmpname = this->m_filename + ".tmp";
+   ASSERTE( save_certificates_file( tmpname, certs ), uniproxy::error::file_failed_copy, "Failed to write: " + tmpname );
+   boost::filesystem::rename( tmpname, this->m_filename );
+}
+
+
+void certificate_store::publish( const std::shared_ptr<index_type> &_index )
+{
+   std::atomic_store( &this->m_index, snapshot(_index) );
+}
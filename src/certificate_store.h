@@ -0,0 +1,79 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _certificate_store_h
+#define _certificate_store_h
+
+#include "applutil.h"
+#include <chrono>
+#include <unordered_map>
+
+
+struct certificate_entry
+{
+   certificate_type cert;
+   std::string name;           // The common name.
+   std::string fingerprint;    // SHA-256 in hex.
+   std::chrono::system_clock::time_point expires;
+};
+
+
+//
+// The trusted remote certificates (certs.pem) indexed by common name.
+//
+// Readers get an immutable snapshot without locking. Changes copy the index, write the file
+// (through a temporary file and a rename) and then publish the new snapshot. The file is only
+// written when the contents change.
+//
+class certificate_store
+{
+public:
+
+   typedef std::unordered_map<std::string, certificate_entry> index_type;
+   typedef std::shared_ptr<const index_type> snapshot;
+
+   certificate_store( const std::string &_filename );
+
+   // (Re)load the file, e.g. after it is changed by others.
+   bool load();
+
+   snapshot get() const;
+   bool contains( const std::string &_name ) const;
+   // Nullptr if not found.
+   std::shared_ptr<const certificate_entry> find( const std::string &_name ) const;
+
+   // Add or replace the certificate with the same common name. Returns false if it was already there.
+   bool add( const certificate_type &_cert );
+   bool add( const std::vector<certificate_type> &_certs );
+   // Returns false if the name was not found.
+   bool remove( const std::string &_name );
+
+   const std::string &filename() const { return this->m_filename; }
+
+private:
+
+   static certificate_entry make_entry( const certificate_type &_cert );
+   void save( const index_type &_index );
+   void publish( const std::shared_ptr<index_type> &_index );
+
+   std::string m_filename;
+   std::mutex m_mutex; // Serializes the writers.
+   snapshot m_index;   // Only through std::atomic_load/std::atomic_store.
+};
+
+#endif
@@ -0,0 +1,265 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "connector.h"
+#include <boost/asio/steady_timer.hpp>
+
+// On IOCP a socket can only be released from its io_service as of Windows 8.1.
+#if defined(_WIN32) && _WIN32_WINNT < 0x0603
+#error "The connector requires _WIN32_WINNT >= 0x0603 (Windows 8.1)"
+#endif
+#include <functional>
+
+using boost::asio::ip::tcp;
+
+
+// One connect, kept alive by its pending handlers.
+class connector::operation : public std::enable_shared_from_this<connector::operation>
+{
+public:
+
+   operation( boost::asio::io_service &_io_service, const std::vector<endpoint> &_endpoints, std::chrono::milliseconds _stagger, std::chrono::milliseconds _timeout, handler _handler );
+
+   void start();
+   void cancel();
+
+   std::vector<size_t> m_failed;
+
+private:
+
+   struct attempt
+   {
+      attempt( boost::asio::io_service &_io_service ) : resolver(_io_service), socket(_io_service) {}
+      tcp::resolver resolver;
+      tcp::socket socket;
+   };
+
+   void start_next();
+   void fail( size_t _index, const boost::system::error_code &_error );
+   void stop();
+   void finish( const boost::system::error_code &_error );
+
+   const std::vector<endpoint> m_endpoints;
+   const std::chrono::milliseconds m_stagger;
+   std::vector<std::unique_ptr<attempt>> m_attempts;
+   boost::asio::steady_timer m_stagger_timer, m_deadline;
+   handler m_handler;
+   size_t m_started = 0, m_failed_count = 0;
+   int m_winner = -1;
+   bool m_stopped = false;
+   boost::system::error_code m_last_error = boost::asio::error::host_not_found;
+};
+
+
+connector::operation::operation( boost::asio::io_service &_io_service, const std::vector<endpoint> &_endpoints, std::chrono::milliseconds _stagger, std::chrono::milliseconds _timeout, handler _handler )
+:  m_endpoints(_endpoints),
+   m_stagger(_stagger),
+   m_stagger_timer(_io_service),
+   m_deadline(_io_service),
+   m_handler(_handler)
+{
+   for ( size_t index = 0; index < _endpoints.size(); index++ )
+   {
+      this->m_attempts.emplace_back( new attempt(_io_service) );
+   }
+   this->m_deadline.expires_after( _timeout );
+}
+
+
+void connector::operation::start()
+{
+   auto self(shared_from_this());
+   this->m_deadline.async_wait( [this, self]( const boost::system::error_code &_error )
+   {
+      if ( !_error && !this->m_stopped )
+      {
+         this->m_last_error = boost::asio::error::timed_out;
+         this->stop();
+         this->finish( this->m_last_error );
+      }
+   });
+   this->start_next();
+}
+
+
+void connector::operation::cancel()
+{
+   this->m_handler = nullptr;
+   this->stop();
+}
+
+
+// Everything but the winner is cancelled, the handlers of the cancelled operations then do nothing.
+void connector::operation::stop()
+{
+   this->m_stopped = true;
+   boost::system::error_code ec;
+   this->m_stagger_timer.cancel( ec );
+   this->m_deadline.cancel( ec );
+   for ( size_t index = 0; index < this->m_attempts.size(); index++ )
+   {
+      if ( (int)index != this->m_winner )
+      {
+         this->m_attempts[index]->resolver.cancel();
+         this->m_attempts[index]->socket.close( ec );
+      }
+   }
+}
+
+
+void connector::operation::finish( const boost::system::error_code &_error )
+{
+   handler result;
+   result.swap( this->m_handler );
+   if ( result )
+   {
+      result( _error, std::max(this->m_winner, 0), this->m_attempts[std::max(this->m_winner, 0)]->socket );
+   }
+}
+
+
+void connector::operation::fail( size_t _index, const boost::system::error_code &_error )
+{
+   if ( this->m_stopped )
+   {
+      return; // Cancelled, e.g. by the deadline, not a failure of the endpoint.
+   }
+   DOUT("Failed connection to: " << this->m_endpoints[_index].first << ":" << this->m_endpoints[_index].second << " " << _error.message());
+   this->m_last_error = _error;
+   this->m_failed.push_back( _index );
+   if ( ++this->m_failed_count == this->m_attempts.size() )
+   {
+      this->stop();
+      this->finish( this->m_last_error );
+   }
+   else if ( this->m_failed_count == this->m_started )
+   {
+      this->start_next(); // Nothing in progress, do not wait for the stagger.
+   }
+}
+
+
+void connector::operation::start_next()
+{
+   if ( this->m_stopped || this->m_started == this->m_attempts.size() )
+   {
+      return;
+   }
+   auto self(shared_from_this());
+   const size_t index = this->m_started++;
+   DOUT("Attempting connect to: " << this->m_endpoints[index].first << ":" << this->m_endpoints[index].second);
+   this->m_attempts[index]->resolver.async_resolve( this->m_endpoints[index].first, mylib::to_string(this->m_endpoints[index].second),
+      [this, self, index]( const boost::system::error_code &_error, tcp::resolver::results_type _results )
+   {
+      if ( this->m_stopped )
+      {
+         return;
+      }
+      if ( _error )
+      {
+         this->fail( index, _error );
+         return;
+      }
+      boost::asio::async_connect( this->m_attempts[index]->socket, _results, [this, self, index]( const boost::system::error_code &_error, const tcp::endpoint &_endpoint )
+      {
+         if ( this->m_stopped )
+         {
+            return;
+         }
+         if ( _error )
+         {
+            this->fail( index, _error );
+            return;
+         }
+         DOUT("Connected to: " << _endpoint);
+         this->m_winner = (int)index;
+         this->stop();
+         this->finish( boost::system::error_code() );
+      });
+   });
+   if ( this->m_started < this->m_attempts.size() )
+   {
+      this->m_stagger_timer.expires_after( this->m_stagger );
+      this->m_stagger_timer.async_wait( [this, self]( const boost::system::error_code &_error ) { if ( !_error ) this->start_next(); } );
+   }
+}
+
+
+connector::connector( std::chrono::milliseconds _stagger, std::chrono::milliseconds _timeout )
+:  m_stagger(_stagger),
+   m_timeout(_timeout)
+{
+}
+
+
+connector::~connector()
+{
+   this->cancel();
+}
+
+
+size_t connector::connect( tcp::socket &_socket, const std::vector<endpoint> &_endpoints, std::vector<size_t> *_failed ) const
+{
+   ASSERTE( !_endpoints.empty(), uniproxy::error::socket_invalid, "No endpoints to connect to" );
+   boost::asio::io_service io_service;
+   boost::system::error_code result;
+   size_t winner = 0;
+   auto op = std::make_shared<operation>( io_service, _endpoints, this->m_stagger, this->m_timeout, [&]( const boost::system::error_code &_error, size_t _index, tcp::socket &_connected )
+   {
+      result = _error;
+      winner = _index;
+      if ( !_error )
+      {
+         // Move the connection to the socket of the caller, which may belong to another io_service.
+         boost::system::error_code ec;
+         _socket.close( ec );
+         const tcp::endpoint remote = _connected.remote_endpoint();
+         _socket.assign( remote.protocol(), _connected.release() );
+      }
+   });
+   op->start();
+   io_service.run();
+   if ( _failed )
+   {
+      _failed->insert( _failed->end(), op->m_failed.begin(), op->m_failed.end() );
+   }
+   if ( result )
+   {
+      throw boost::system::system_error( result );
+   }
+   return winner;
+}
+
+
+void connector::async_connect( boost::asio::io_service &_io_service, const std::vector<endpoint> &_endpoints, handler _handler )
+{
+   ASSERTE( !_endpoints.empty(), uniproxy::error::socket_invalid, "No endpoints to connect to" );
+   this->cancel();
+   this->m_operation = std::make_shared<operation>( _io_service, _endpoints, this->m_stagger, this->m_timeout, _handler );
+   this->m_operation->start();
+}
+
+
+void connector::cancel()
+{
+   if ( this->m_operation )
+   {
+      this->m_operation->cancel();
+      this->m_operation.reset();
+   }
+}
@@ -0,0 +1,73 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _connector_h
+#define _connector_h
+
+#include "applutil.h"
+
+
+//
+// Connects to the first reachable of a list of endpoints, happy eyeballs style.
+// The attempts are started in the order given, the next one when the stagger expires or as soon as
+// all started attempts have failed. So a dead endpoint delays the connection by the stagger instead
+// of a full TCP connect timeout. The first connection established is kept, the others are closed.
+//
+class connector
+{
+public:
+
+   typedef std::pair<std::string, int> endpoint; // hostname, port
+
+   // The error, and on success the index of the endpoint and the connected socket, which may be moved.
+   typedef std::function<void( const boost::system::error_code &, size_t, boost::asio::ip::tcp::socket & )> handler;
+
+   connector( std::chrono::milliseconds _stagger = std::chrono::milliseconds(250), std::chrono::milliseconds _timeout = std::chrono::seconds(30) );
+   ~connector();
+
+   // Blocking, the attempts run on a private io_service. Returns the index of the connected endpoint.
+   // Throws the last error if none could be connected within the timeout.
+   // The indexes of the endpoints that failed are added to _failed, if given.
+   size_t connect( boost::asio::ip::tcp::socket &_socket, const std::vector<endpoint> &_endpoints, std::vector<size_t> *_failed = nullptr ) const;
+
+   // The attempts run on _io_service, which also calls the handler. The connected socket belongs to _io_service.
+   void async_connect( boost::asio::io_service &_io_service, const std::vector<endpoint> &_endpoints, handler _handler );
+   // Stops the async_connect, the handler is not called. In the context of its io_service, also done when destroyed.
+   void cancel();
+
+   // The hostname and port of the items, e.g. LocalEndpoint or RemoteEndpoint, in the order of the indexes.
+   template<class T> static std::vector<endpoint> endpoints( const std::vector<T> &_items, const std::vector<int> &_indexes )
+   {
+      std::vector<endpoint> result;
+      for ( int index : _indexes )
+      {
+         result.emplace_back( _items[index].m_hostname, _items[index].m_port );
+      }
+      return result;
+   }
+
+private:
+
+   class operation;
+
+   std::chrono::milliseconds m_stagger;
+   std::chrono::milliseconds m_timeout;
+   std::shared_ptr<operation> m_operation; // Of async_connect.
+};
+
+#endif
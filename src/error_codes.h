@@ -15,4 +15,5 @@ error_code_def(logon_no_response, "no response" ),
 error_code_def(thread_already_running, "thread already running" ),
 error_code_def(socket_invalid, "invalid socket" ),
 error_code_def(file_failed_copy, "failed to copy file" ),
+error_code_def(spool_invalid, "invalid spool segment" ),
 error_code_def(unknown_error, NULL )
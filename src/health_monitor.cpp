@@ -0,0 +1,275 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "health_monitor.h"
+#include "cppcms_util.h"
+#include <set>
+
+using boost::asio::ip::tcp;
+
+
+health_monitor::health_monitor()
+:  m_timer(m_io_service),
+   m_random(std::random_device{}()),
+   m_thread([this](){ this->m_io_service.stop(); })
+{
+}
+
+
+health_monitor::~health_monitor()
+{
+   this->stop();
+}
+
+
+void health_monitor::load_json(const cppcms::json::value &_json)
+{
+   this->m_interval = std::max(0, cppcms::utils::check_int(_json, "probe_interval", this->m_interval, false));
+   this->m_jitter = std::max(0, cppcms::utils::check_int(_json, "probe_jitter", this->m_jitter, false));
+   this->m_timeout = std::max(1, cppcms::utils::check_int(_json, "probe_timeout", this->m_timeout, false));
+   this->m_failures = std::max(1, cppcms::utils::check_int(_json, "probe_failures", this->m_failures, false));
+   DOUT("Probe interval: " << this->m_interval << " jitter: " << this->m_jitter << " timeout: " << this->m_timeout << " failures: " << this->m_failures);
+}
+
+
+void health_monitor::start(std::function<std::vector<target>()> _targets)
+{
+   if (this->m_thread.is_running())
+   {
+      return;
+   }
+   this->m_targets = _targets;
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex);
+      for (auto &item : this->m_results) // Probes pending at the last stop.
+      {
+         item.second.probing = false;
+      }
+   }
+   this->m_io_service.restart(); // Here, so a stop right after the start is not lost.
+   this->m_thread.start([this]{ this->threadproc(); });
+}
+
+
+void health_monitor::stop()
+{
+   this->m_thread.stop();
+}
+
+
+void health_monitor::threadproc()
+{
+   DOUT(__FUNCTION__);
+   this->m_timer.expires_after(std::chrono::seconds(1));
+   this->m_timer.async_wait([this](const boost::system::error_code &_error){ this->tick(_error); });
+   while (this->m_thread.check_run(false))
+   {
+      try
+      {
+         this->m_io_service.run();
+         break;
+      }
+      catch (std::exception &exc)
+      {
+         DERR("Health monitor: " << exc.what());
+      }
+   }
+   DOUT(__FUNCTION__ << " stopped");
+}
+
+
+// A random delay up to _max_seconds, or between the interval plus and minus the jitter.
+std::chrono::steady_clock::duration health_monitor::next_delay(int _max_seconds)
+{
+   int from = _max_seconds < 0 ? (this->m_interval - this->m_jitter) * 1000 : 0;
+   int to = _max_seconds < 0 ? (this->m_interval + this->m_jitter) * 1000 : _max_seconds * 1000;
+   return std::chrono::milliseconds(std::uniform_int_distribution<>(std::max(from, 1000), std::max(to, 1000))(this->m_random));
+}
+
+
+void health_monitor::tick(const boost::system::error_code &_error)
+{
+   if (_error == boost::asio::error::operation_aborted)
+   {
+      return;
+   }
+   this->m_timer.expires_after(std::chrono::seconds(1));
+   this->m_timer.async_wait([this](const boost::system::error_code &_error){ this->tick(_error); });
+   if (this->m_interval == 0)
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex);
+      this->m_results.clear();
+      return;
+   }
+
+   std::vector<target> targets = this->m_targets();
+   const auto now = std::chrono::steady_clock::now();
+   std::vector<std::string> due;
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex);
+      std::set<std::string> keys;
+      for (auto &item : targets)
+      {
+         const std::string key = item.hostname + ":" + mylib::to_string(item.port);
+         keys.insert(key);
+         if (this->m_results.count(key) == 0)
+         {
+            result &res = this->m_results[key];
+            res.hostname = item.hostname;
+            res.port = item.port;
+            res.kind = item.kind;
+            res.next = now + this->next_delay(this->m_jitter); // Spread the first probes.
+         }
+      }
+      for (auto iter = this->m_results.begin(); iter != this->m_results.end(); )
+      {
+         if (keys.count(iter->first) == 0 && !iter->second.probing) // No longer configured.
+         {
+            iter = this->m_results.erase(iter);
+            continue;
+         }
+         if (!iter->second.probing && iter->second.next <= now)
+         {
+            iter->second.probing = true;
+            due.push_back(iter->first);
+         }
+         ++iter;
+      }
+   }
+   for (auto &key : due)
+   {
+      this->probe(key);
+   }
+}
+
+
+void health_monitor::probe(const std::string &_key)
+{
+   struct probe_state
+   {
+      probe_state(boost::asio::io_service &_io_service) : resolver(_io_service), socket(_io_service), timer(_io_service) {}
+      tcp::resolver resolver;
+      tcp::socket socket;
+      boost::asio::steady_timer timer;
+   };
+   std::string hostname;
+   int port;
+   {
+      std::lock_guard<std::mutex> lock(this->m_mutex);
+      hostname = this->m_results[_key].hostname;
+      port = this->m_results[_key].port;
+   }
+   auto state = std::make_shared<probe_state>(this->m_io_service);
+   const auto start = std::chrono::steady_clock::now();
+   state->timer.expires_after(std::chrono::seconds(this->m_timeout));
+   state->timer.async_wait([state](const boost::system::error_code &_error)
+   {
+      if (!_error)
+      {
+         boost::system::error_code ec;
+         state->resolver.cancel();
+         state->socket.close(ec);
+      }
+   });
+   state->resolver.async_resolve(hostname, mylib::to_string(port), [this, state, start, _key](const boost::system::error_code &_error, tcp::resolver::results_type _results)
+   {
+      if (_error)
+      {
+         state->timer.cancel();
+         this->probed(_key, start, _error == boost::asio::error::operation_aborted ? boost::asio::error::timed_out : _error);
+         return;
+      }
+      boost::asio::async_connect(state->socket, _results, [this, state, start, _key](const boost::system::error_code &_error, const tcp::endpoint &)
+      {
+         state->timer.cancel();
+         boost::system::error_code ec;
+         state->socket.close(ec);
+         this->probed(_key, start, _error == boost::asio::error::operation_aborted ? boost::asio::error::timed_out : _error);
+      });
+   });
+}
+
+
+void health_monitor::probed(const std::string &_key, std::chrono::steady_clock::time_point _start, const boost::system::error_code &_error)
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   auto iter = this->m_results.find(_key);
+   if (iter == this->m_results.end())
+   {
+      return;
+   }
+   result &res = iter->second;
+   res.probing = false;
+   res.probes++;
+   res.next = std::chrono::steady_clock::now() + this->next_delay(-1);
+   if (_error)
+   {
+      if (++res.failures == this->m_failures)
+      {
+         DERR("Endpoint not responding: " << _key << " (" << res.kind << ") " << _error.message());
+      }
+      res.last_error = _error.message();
+      return;
+   }
+   if (res.failures >= this->m_failures)
+   {
+      DOUT("Endpoint responding again: " << _key << " (" << res.kind << ")");
+   }
+   res.failures = 0;
+   res.latency_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start).count();
+   res.last_success = boost::get_system_time();
+}
+
+
+bool health_monitor::alive(const std::string &_hostname, int _port) const
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   auto iter = this->m_results.find(_hostname + ":" + mylib::to_string(_port));
+   return iter == this->m_results.end() || iter->second.failures < this->m_failures;
+}
+
+
+cppcms::json::value health_monitor::save_json_status() const
+{
+   std::lock_guard<std::mutex> lock(this->m_mutex);
+   cppcms::json::value obj;
+   obj = cppcms::json::array();
+   int index = 0;
+   for (auto &item : this->m_results)
+   {
+      const result &res = item.second;
+      cppcms::json::value ep;
+      ep["hostname"] = res.hostname;
+      ep["port"] = res.port;
+      ep["kind"] = res.kind;
+      ep["alive"] = res.failures < this->m_failures;
+      ep["probes"] = (int)res.probes;
+      ep["failures"] = res.failures;
+      ep["latency_ms"] = res.latency_ms;
+      if (!res.last_success.is_not_a_date_time())
+      {
+         ep["last_success"] = mylib::to_string(res.last_success);
+      }
+      if (res.failures > 0)
+      {
+         ep["last_error"] = res.last_error;
+      }
+      obj[index++] = ep;
+   }
+   return obj;
+}
@@ -0,0 +1,104 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _health_monitor_h
+#define _health_monitor_h
+
+#include "applutil.h"
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <random>
+
+
+//
+// Probes the configured endpoints in the background with a TCP connect: the locals of the hosts and providers
+// and the remotes of the clients. Each endpoint is probed every "probe_interval" seconds, plus or minus up to
+// "probe_jitter" seconds so the probes do not line up. All probes run on one io_service and thread.
+//
+// An endpoint is dead after "probe_failures" consecutive failed probes, the connect paths then try it last.
+//
+class health_monitor
+{
+public:
+
+   struct target
+   {
+      std::string hostname;
+      int port;
+      std::string kind; // "local" or "remote"
+   };
+
+   health_monitor();
+   ~health_monitor();
+
+   // "probe_interval" (0 disables), "probe_jitter", "probe_timeout" and "probe_failures" from the "config" section.
+   void load_json(const cppcms::json::value &_json);
+
+   // The endpoints are fetched from _targets once a second, so configuration changes are picked up.
+   void start(std::function<std::vector<target>()> _targets);
+   void stop();
+
+   // Unknown endpoints are alive.
+   bool alive(const std::string &_hostname, int _port) const;
+
+   // Moves the indexes of the dead items, e.g. LocalEndpoint or RemoteEndpoint, last. The order is kept otherwise.
+   template<class T> void prefer_alive(std::vector<int> &_indexes, const std::vector<T> &_items) const
+   {
+      std::stable_partition(_indexes.begin(), _indexes.end(), [&](int index){ return this->alive(_items[index].m_hostname, _items[index].m_port); });
+   }
+
+   cppcms::json::value save_json_status() const;
+
+private:
+
+   struct result
+   {
+      std::string hostname;
+      int port = 0;
+      std::string kind;
+      int latency_ms = 0;
+      int failures = 0; // Consecutive.
+      uint64_t probes = 0;
+      boost::posix_time::ptime last_success;
+      std::string last_error;
+      bool probing = false;
+      std::chrono::steady_clock::time_point next;
+   };
+
+   void threadproc();
+   void tick(const boost::system::error_code &_error);
+   void probe(const std::string &_key);
+   void probed(const std::string &_key, std::chrono::steady_clock::time_point _start, const boost::system::error_code &_error);
+   std::chrono::steady_clock::duration next_delay(int _max_seconds);
+
+   std::atomic<int> m_interval{30};  // Seconds
+   std::atomic<int> m_jitter{5};     // Seconds
+   std::atomic<int> m_timeout{5};    // Seconds
+   std::atomic<int> m_failures{2};
+
+   std::function<std::vector<target>()> m_targets;
+   boost::asio::io_service m_io_service;
+   boost::asio::steady_timer m_timer;
+   std::mt19937 m_random;
+   mylib::thread m_thread;
+
+   mutable std::mutex m_mutex;
+   std::map<std::string, result> m_results; // By hostname:port
+};
+
+#endif
@@ -20,43 +20,169 @@
 
 #include <boost/bind.hpp>
 #include "proxy_global.h"
+#include "cppcms_util.h"
+#include "connector.h"
 #include <random>
 
 using boost::asio::ip::tcp;
 using boost::asio::deadline_timer;
 
 
+lag_policy lag_policy_from_string(const std::string &_name)
+{
+   if (_name == "drop")
+   {
+      return lag_policy::drop;
+   }
+   if (_name == "disconnect")
+   {
+      return lag_policy::disconnect;
+   }
+   ASSERTE(_name.empty() || _name == "block", uniproxy::error::parse_file_failed, "Unknown lag policy: " + _name);
+   return lag_policy::block;
+}
+
+
+std::string to_string(lag_policy _policy)
+{
+   switch (_policy)
+   {
+   case lag_policy::drop: return "drop";
+   case lag_policy::disconnect: return "disconnect";
+   default: return "block";
+   }
+}
+
+
 int LocalHostSocket::id_gen = 0;
 
-LocalHostSocket::LocalHostSocket(LocalHost &_host, boost::asio::ip::tcp::socket *_socket)
-: m_host(_host)
+LocalHostSocket::LocalHostSocket(LocalHost &_host, boost::asio::io_service &_io_service)
+: m_socket(_io_service),
+  m_read_buffer(_host.m_read_buffer_size, _host.m_read_buffer_adaptive),
+  m_host(_host)
+{
+   this->id = ++id_gen;
+}
+
+
+// The socket is closed when recycled. The read buffer is kept with the size it has adapted to.
+void LocalHostSocket::reset()
 {
    this->id = ++id_gen;
-   this->m_socket = _socket;
+   this->m_queue.clear();
+   this->m_writing = false;
+   this->m_dropped = 0;
+}
+
+
+void LocalHostSocket::start_read()
+{
+   this->socket().async_read_some(this->m_read_buffer.buffer(),
+      boost::bind(&LocalHostSocket::handle_local_read, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
 }
 
 
 void LocalHostSocket::handle_local_read(const boost::system::error_code& _error,size_t _bytes_transferred)
 {
+   if (!_error)
+   {
+      this->m_read_buffer.update(_bytes_transferred);
+   }
    this->m_host.handle_local_read(*this, _error, _bytes_transferred);
 }
 
 
+bool LocalHostSocket::is_full() const
+{
+   return this->pending() >= this->m_host.m_queue_size;
+}
+
+
+bool LocalHostSocket::send(const chunk &_chunk)
+{
+   if (this->is_full())
+   {
+      switch (this->m_host.m_lag_policy)
+      {
+      case lag_policy::drop:
+         this->m_queue.erase(this->m_queue.begin() + (this->m_writing ? 1 : 0));
+         if (this->m_dropped++ == 0)
+         {
+            DERR(this->m_host.info() << local_address_port(this->socket()) << " Local consumer lagging, dropping data");
+         }
+         break;
+      case lag_policy::disconnect:
+         return false;
+      case lag_policy::block:
+         break; // The remote read is paused, so we only go one chunk beyond.
+      }
+   }
+   this->m_queue.push_back(_chunk);
+   if (!this->m_writing)
+   {
+      this->start_write();
+   }
+   return true;
+}
+
+
+void LocalHostSocket::start_write()
+{
+   this->m_writing = true;
+   const chunk &front = this->m_queue.front();
+   boost::asio::async_write(this->socket(), boost::asio::buffer(front->data(), front->size()),
+      boost::bind(&LocalHostSocket::handle_local_write, shared_from_this(), boost::asio::placeholders::error));
+}
+
+
+void LocalHostSocket::handle_local_write(const boost::system::error_code& error)
+{
+   this->m_writing = false;
+   if (error)
+   {
+      DOUT(this->m_host.info() << local_address_port(this->socket()) << " One of the attached sockets disconnected: " << remote_address_port(this->socket()));
+      this->m_queue.clear();
+      this->m_host.remove_socket(*this);
+      if (this->m_host.m_local_sockets.empty())
+      {
+         throw std::runtime_error( __FUNCTION__ );
+      }
+      this->m_host.resume_remote_read();
+      return;
+   }
+   this->m_queue.pop_front();
+   if (!this->m_queue.empty())
+   {
+      this->start_write();
+   }
+   this->m_host.resume_remote_read();
+}
+
+
 boost::asio::ip::tcp::socket &LocalHostSocket::socket()
 {
-   ASSERTE(this->m_socket,uniproxy::error::socket_invalid,"Fatal Invalid socket");
-   return *this->m_socket;
+   return this->m_socket;
 }
 
 
 LocalHost::LocalHost(bool _active, mylib::port_type _local_port, mylib::port_type _activate_port, const std::vector<RemoteEndpoint> &_proxy_endpoints,
-   const int _max_connections, PluginHandler &_plugin, const boost::posix_time::time_duration &_read_timeout, bool auto_reconnect)
+   const int _max_connections, PluginHandler &_plugin, const boost::posix_time::time_duration &_read_timeout, bool auto_reconnect, const cppcms::json::value &_json)
    : BaseClient(_active, _local_port, _activate_port, _proxy_endpoints, _max_connections, _plugin),
    m_read_timeout(_read_timeout),
    m_auto_reconnect(auto_reconnect),
    m_thread([this] { this->interrupt(); })
 {
    this->m_local_connected = false; 
+   this->load_read_buffer(_json);
+   this->m_coalescer.load_json(_json);
+   this->m_queue_size = std::max(1, cppcms::utils::check_int(_json, "queue_size", (int)this->m_queue_size, false));
+   std::string policy;
+   cppcms::utils::check_string(_json, "lag_policy", policy);
+   this->m_lag_policy = lag_policy_from_string(policy);
+   DOUT(info() << "Queue size: " << this->m_queue_size << " lag policy: " << to_string(this->m_lag_policy));
+   cppcms::utils::check_bool(_json, "hold_locals", this->m_hold_locals);
+   this->m_gap_queue_size = std::max(0, cppcms::utils::check_int(_json, "gap_queue_size", (int)this->m_gap_queue_size, false));
+   DOUT(info() << "Hold locals: " << this->m_hold_locals << " gap queue size: " << this->m_gap_queue_size);
 }
 
 
@@ -123,9 +249,13 @@ void LocalHost::cleanup()
          TRY_CATCH( this->m_local_sockets.front()->socket().close(ec) );
 
          std::lock_guard<std::mutex> l(this->m_mutex_base);
-         this->m_local_sockets.erase( this->m_local_sockets.begin() ); // Since we use shared_ptr it should autodelete.
+         this->m_local_sockets.erase( this->m_local_sockets.begin() ); // Recycled when the last reference is gone.
       }
-      this->mp_acceptor = nullptr;
+      this->m_remote_writes.clear();
+      this->m_paused_sockets.clear();
+      this->m_gap_queue.clear();
+      this->m_gap_queue_bytes = 0;
+      this->m_remote_connected = false;
    }
    catch( std::exception &exc )
    {
@@ -135,17 +265,31 @@ void LocalHost::cleanup()
 
 
 // The interrupt function may happen in local or other (main) thread context.
+// Also breaks the synchronous accept, the acceptor is opened again when the thread is restarted.
 void LocalHost::interrupt()
 {
    try
    {
       DOUT(info() << "Enter");
-      this->mp_acceptor->cancel();
       if (int sock = get_socket(this->mp_acceptor, this->m_mutex_base); sock != 0)
       {
          DOUT(info() << "Shutdown acceptor");
          shutdown(sock, boost::asio::socket_base::shutdown_both);
       }
+   }
+   catch( std::exception &exc )
+   {
+      this->dolog(info() + exc.what());
+   }
+   this->shutdown_sockets();
+}
+
+
+// Ends the current connection cycle, the acceptor is kept. May happen in local or other (main) thread context.
+void LocalHost::shutdown_sockets()
+{
+   try
+   {
       std::vector<int> socks;
       {
          std::lock_guard<std::mutex> l(this->m_mutex_base);
@@ -171,12 +315,13 @@ void LocalHost::interrupt()
 }
 
 
-void LocalHost::remove_socket( boost::asio::ip::tcp::socket &_socket )
+void LocalHost::remove_socket( LocalHostSocket &_hostsocket )
 {
    for ( auto iter = this->m_local_sockets.begin(); iter != this->m_local_sockets.end(); iter++ )
    {
-      if ( (*iter)->socket() == _socket )
+      if ( iter->get() == &_hostsocket )
       {
+         boost::asio::ip::tcp::socket &_socket(_hostsocket.socket());
          boost::system::error_code ec;
          TRY_CATCH( _socket.shutdown(boost::asio::socket_base::shutdown_both,ec) );
          TRY_CATCH( _socket.close(ec) );
@@ -194,20 +339,16 @@ void LocalHost::handle_local_read( LocalHostSocket &_hostsocket, const boost::sy
    if (!error)
    {
       this->m_count_out.add( bytes_transferred );
-      Buffer buffer( this->m_local_data, bytes_transferred );
-      this->m_last_outgoing_msg = this->m_local_data;
+      const char *data = _hostsocket.data();
+      this->m_last_outgoing_msg.assign(data, bytes_transferred);
       this->m_last_outgoing_stamp = boost::get_system_time();
-      if (global.m_out_data_log_file.is_open())
-      {
-         this->m_local_data[bytes_transferred] = 0;
-         global.m_out_data_log_file << "[" << mylib::to_string(boost::get_system_time()) << "]" << this->m_local_data;
-      }
-      boost::asio::async_write( this->remote_socket(), boost::asio::buffer( this->m_local_data, bytes_transferred), boost::bind(&LocalHost::handle_remote_write, this, _hostsocket.id, boost::asio::placeholders::error));
+      global.m_capture.add(this->m_capture, this->remote_name(), capture::out, data, bytes_transferred);
+      this->queue_remote_write(_hostsocket.shared_from_this(), bytes_transferred);
    }
    else
    {
       DERR(local_address_port(_hostsocket.socket()) << " Error: " << error << " connections: " << this->m_local_sockets.size());
-      this->remove_socket(_hostsocket.socket());
+      this->remove_socket(_hostsocket);
       DOUT(info() << " Last outgoing msg: " << this->m_last_outgoing_stamp << ":" << this->m_last_outgoing_msg << " connections: " << this->m_local_sockets.size());
       if (this->m_local_sockets.empty())
       {
@@ -217,28 +358,204 @@ void LocalHost::handle_local_read( LocalHostSocket &_hostsocket, const boost::sy
 }
 
 
-void LocalHost::handle_local_write( boost::asio::ip::tcp::socket *_socket, const boost::system::error_code& error)
+// The local consumers share the remote connection, so their writes are gathered or queued and performed one at a time.
+// A consumer does not read again until its data has been written or gathered.
+void LocalHost::queue_remote_write(const std::shared_ptr<LocalHostSocket> &_hostsocket, size_t bytes_transferred)
 {
-   this->m_write_count--;
-   ASSERTE(this->m_pdeadline != nullptr, boost::system::errc::timed_out, "deadline timer out of scope");
-   if (!error)
+   if (!this->m_remote_connected)
    {
+      this->queue_gap(_hostsocket->data(), bytes_transferred);
+      _hostsocket->start_read();
+      return;
    }
-   else
+   if (this->m_coalescer.enabled())
+   {
+      this->m_coalescer.append(_hostsocket->data(), bytes_transferred);
+      if (this->m_coalescer.full())
+      {
+         this->m_paused_sockets.push_back(_hostsocket);
+      }
+      else
+      {
+         _hostsocket->start_read();
+      }
+      this->flush_remote(false);
+      return;
+   }
+   this->m_remote_writes.emplace_back(_hostsocket, bytes_transferred);
+   if (this->m_remote_writes.size() == 1)
+   {
+      this->start_remote_write();
+   }
+}
+
+
+// Keeps the data while the remote is not connected. The oldest data is dropped beyond the gap queue size.
+void LocalHost::queue_gap(const char *_data, size_t _size)
+{
+   this->m_gap_queue.push_back(std::make_shared<const std::string>(_data, _size));
+   this->m_gap_queue_bytes += _size;
+   while (this->m_gap_queue_bytes > this->m_gap_queue_size && !this->m_gap_queue.empty())
+   {
+      if (this->m_gap_dropped++ == 0)
+      {
+         DERR(info() << "Remote not connected, gap queue full, dropping data");
+      }
+      this->m_gap_queue_bytes -= this->m_gap_queue.front()->size();
+      this->m_gap_queue.pop_front();
+   }
+}
+
+
+// Writes the data gathered while the remote was not connected, before the local consumers write directly again.
+void LocalHost::flush_gap()
+{
+   if (this->m_gap_queue.empty())
+   {
+      this->m_remote_connected = true;
+      return;
+   }
+   auto chunks = std::make_shared<std::vector<LocalHostSocket::chunk>>(this->m_gap_queue.begin(), this->m_gap_queue.end());
+   DOUT(info() << "Writing " << this->m_gap_queue_bytes << " bytes gathered while disconnected, dropped chunks: " << this->m_gap_dropped);
+   this->m_gap_queue.clear();
+   this->m_gap_queue_bytes = 0;
+   this->m_gap_dropped = 0;
+   std::vector<boost::asio::const_buffer> buffers;
+   for (auto &item : *chunks)
+   {
+      buffers.push_back(boost::asio::buffer(item->data(), item->size()));
+   }
+   boost::asio::async_write( this->remote_socket(), buffers, boost::bind(&LocalHost::handle_gap_write, this, chunks, boost::asio::placeholders::error));
+}
+
+
+void LocalHost::handle_gap_write(const std::shared_ptr<std::vector<LocalHostSocket::chunk>> &_chunks, const boost::system::error_code& error)
+{
+   if (error == boost::asio::error::operation_aborted)
+   {
+      return;
+   }
+   if (error)
+   {
+      DOUT(info() << "Error: " << error << " in " << __FUNCTION__ << ":" <<__LINE__);
+      throw boost::system::system_error( error );
+   }
+   this->flush_gap(); // More may have been gathered meanwhile.
+}
+
+
+void LocalHost::start_remote_write()
+{
+   auto &item = this->m_remote_writes.front();
+   boost::asio::async_write( this->remote_socket(), boost::asio::buffer( item.first->data(), item.second), boost::bind(&LocalHost::handle_remote_write, this, boost::asio::placeholders::error));
+}
+
+
+// Write the gathered data unless a write is in progress, its completion will flush again.
+// Unless forced or full the write is delayed to gather some more.
+void LocalHost::flush_remote(bool _force)
+{
+   if (this->m_coalescer.writing() || this->m_coalescer.pending() == 0)
+   {
+      return;
+   }
+   if (!_force && !this->m_coalescer.full() && this->mp_coalesce_timer != nullptr)
+   {
+      if (!this->m_coalesce_armed)
+      {
+         this->m_coalesce_armed = true;
+         this->mp_coalesce_timer->expires_from_now(this->m_coalescer.delay());
+         this->mp_coalesce_timer->async_wait(boost::bind(&LocalHost::handle_coalesce_timer, this, boost::asio::placeholders::error, ++this->m_coalesce_generation));
+      }
+      return;
+   }
+   if (this->mp_coalesce_timer != nullptr)
+   {
+      boost::system::error_code ec;
+      this->mp_coalesce_timer->cancel(ec);
+   }
+   this->m_coalesce_armed = false;
+   boost::asio::async_write( this->remote_socket(), this->m_coalescer.take(), boost::bind(&LocalHost::handle_remote_write, this, boost::asio::placeholders::error));
+}
+
+
+void LocalHost::handle_coalesce_timer(const boost::system::error_code& error, unsigned _generation)
+{
+   if (error == boost::asio::error::operation_aborted || _generation != this->m_coalesce_generation)
+   {
+      return;
+   }
+   this->m_coalesce_armed = false;
+   this->flush_remote(true);
+}
+
+
+void LocalHost::handle_remote_write(const boost::system::error_code& error)
+{
+   if (error == boost::asio::error::operation_aborted || (!this->m_coalescer.writing() && this->m_remote_writes.empty()))
+   {
+      return; // From a previous remote connection, the consumers have been resumed by go_out.
+   }
+   if (error)
+   {
+      DOUT(info() << "Error: " << error << " in " << __FUNCTION__ << ":" <<__LINE__);
+      throw boost::system::system_error( error );
+   }
+   if (this->m_coalescer.writing())
+   {
+      this->m_coalescer.written();
+      std::vector<std::shared_ptr<LocalHostSocket>> paused;
+      paused.swap(this->m_paused_sockets);
+      for (auto &sock : paused)
+      {
+         if (sock->socket().is_open())
+         {
+            sock->start_read();
+         }
+      }
+      this->flush_remote(true);
+      return;
+   }
+   std::shared_ptr<LocalHostSocket> sock = this->m_remote_writes.front().first;
+   this->m_remote_writes.pop_front();
+   if (sock->socket().is_open())
    {
-      DOUT(info() << local_address_port(*_socket) << " One of the attached sockets disconnected: " << remote_address_port(*_socket));
-      this->remove_socket(*_socket);
+      sock->start_read();
    }
-   if ( this->m_write_count == 0 && this->m_local_sockets.size() > 0 )
+   if (!this->m_remote_writes.empty())
    {
-      this->m_pdeadline->expires_from_now(this->m_read_timeout);
+      this->start_remote_write();
+   }
+}
+
+
+void LocalHost::start_remote_read()
+{
+   ASSERTE(this->m_pdeadline != nullptr, boost::system::errc::timed_out, "deadline timer out of scope");
+   this->m_remote_busy = true;
+   this->m_pdeadline->expires_from_now(this->m_read_timeout);
+   this->remote_socket().async_read_some( this->m_remote_data.buffer(), boost::bind(&LocalHost::handle_remote_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
 
-      this->remote_socket().async_read_some( boost::asio::buffer( this->m_remote_data, max_length), boost::bind(&LocalHost::handle_remote_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+
+// Called whenever a local consumer may have gained room in its queue.
+void LocalHost::resume_remote_read()
+{
+   if (this->m_remote_busy || this->m_local_sockets.empty())
+   {
+      return;
    }
-   if ( this->m_local_sockets.size() == 0 )
+   if (this->m_lag_policy == lag_policy::block)
    {
-      throw std::runtime_error( __FUNCTION__ );       
+      for (auto &sock : this->m_local_sockets)
+      {
+         if (sock->is_full())
+         {
+            return;
+         }
+      }
    }
+   this->start_remote_read();
 }
 
 
@@ -247,21 +564,27 @@ void LocalHost::handle_remote_read(const boost::system::error_code& error,size_t
    ASSERTE(this->m_pdeadline != nullptr, boost::system::errc::timed_out, "deadline timer out of scope");
    if (!error)
    {
+      this->m_remote_busy = false;
       this->m_count_in.add( bytes_transferred );
-      this->m_remote_data[bytes_transferred] = 0;
-      this->m_last_incoming_msg = this->m_remote_data;
+      this->m_remote_data.update( bytes_transferred );
+      auto data = std::make_shared<const std::string>( this->m_remote_data.data(), bytes_transferred );
+      this->m_last_incoming_msg = *data;
       this->m_last_incoming_stamp = boost::get_system_time();
-      if (global.m_in_data_log_file.is_open())
+      global.m_capture.add(this->m_capture, this->remote_name(), capture::in, data->data(), data->size());
+      std::vector<std::shared_ptr<LocalHostSocket>> sockets(this->m_local_sockets); // A lagging consumer may be removed.
+      for (auto &sock : sockets)
       {
-         global.m_in_data_log_file << "[" << mylib::to_string(boost::get_system_time()) << "]" << this->m_remote_data;
+         if (!sock->send(data))
+         {
+            DERR(info() << local_address_port(sock->socket()) << " Local consumer lagging, disconnecting");
+            this->remove_socket(*sock);
+         }
       }
-      this->m_write_count = this->m_local_sockets.size();
-      this->m_pdeadline->expires_from_now(this->m_read_timeout);
-      for ( int index = 0; index < this->m_write_count; index++ )
+      if ( this->m_local_sockets.empty() )
       {
-         boost::asio::ip::tcp::socket *psocket = &this->m_local_sockets[index]->socket();
-         boost::asio::async_write( *psocket, boost::asio::buffer( this->m_remote_data, bytes_transferred), boost::bind(&LocalHost::handle_local_write, this, psocket, boost::asio::placeholders::error));
+         throw std::runtime_error( __FUNCTION__ );
       }
+      this->resume_remote_read();
    }
    else
    {
@@ -272,64 +595,95 @@ void LocalHost::handle_remote_read(const boost::system::error_code& error,size_t
 }
 
 
-void LocalHost::handle_remote_write(int id, const boost::system::error_code& error)
+// A consumer that is not kept is closed and recycled when the handler lets go of it.
+void LocalHost::handle_accept( const std::shared_ptr<LocalHostSocket> &_hostsocket, const boost::system::error_code& error )
 {
+   int count = this->m_local_sockets.size();
+   DOUT(info() << local_address_port(_hostsocket->socket()) << " error?: " << error << " Added extra local socket " << remote_address_port(_hostsocket->socket()) << " now " << this->m_local_sockets.size() << " connections");
    if (!error)
    {
-      for (auto& sock : this->m_local_sockets)
+      if (count < this->m_max_connections)
       {
-         if (sock->id == id)
          {
-            sock->socket().async_read_some(boost::asio::buffer(this->m_local_data, max_length),
-               boost::bind(&LocalHostSocket::handle_local_read, sock,
-               boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-            break;
+            std::lock_guard<std::mutex> l(this->m_mutex_base);
+            this->m_local_sockets.push_back(_hostsocket);
          }
+         _hostsocket->start_read();
+      }
+      else
+      {
+         DOUT(info() << "Already too many connections: " << count << " vs. " << this->m_max_connections);
       }
    }
    else
    {
-      DOUT(info() << "Error: " << error << " in " << __FUNCTION__ << ":" <<__LINE__);
-      throw boost::system::system_error( error );
+      DOUT(info() << " Local removed, now " << this->m_local_sockets.size() << " connections");
+   }
+
+   // Unconditionally we start looking for the next socket.
+   if ( this->mp_acceptor != NULL && this->m_local_sockets.size() > 0)
+   {
+      auto next = this->make_socket();
+      this->mp_acceptor->async_accept( next->socket(), boost::bind(&LocalHost::handle_accept, this, next, boost::asio::placeholders::error));
    }
 }
 
 
-void LocalHost::handle_accept( boost::asio::ip::tcp::socket *_socket, const boost::system::error_code& error )
+std::shared_ptr<LocalHostSocket> LocalHost::make_socket()
 {
-   int count = this->m_local_sockets.size();
-   DOUT(info() << local_address_port(*_socket) << " error?: " << error << " Added extra local socket " << remote_address_port(*_socket) << " now " << this->m_local_sockets.size() << " connections");
-   if (!error && _socket)
+   std::unique_ptr<LocalHostSocket> hostsocket;
    {
-      if (count < this->m_max_connections)
-      {
-         auto p = std::make_shared<LocalHostSocket>(*this, _socket);
-         this->m_local_sockets.push_back(p);
-
-         // NB!! Currently all will read to the same buffer, so it will crash eventually.
-         _socket->async_read_some(boost::asio::buffer(m_local_data, max_length), boost::bind(&LocalHostSocket::handle_local_read, p.get(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-      }
-      else
+      std::lock_guard<std::mutex> lock(this->m_mutex_pool);
+      if (!this->m_free_sockets.empty())
       {
-         DOUT(info() << "Already too many connections: " << count << " vs. " << this->m_max_connections);
-         boost::system::error_code ec;
-         _socket->close(ec);
-         delete _socket;
+         hostsocket = std::move(this->m_free_sockets.back());
+         this->m_free_sockets.pop_back();
       }
    }
+   if (hostsocket)
+   {
+      hostsocket->reset();
+   }
    else
    {
-      DOUT(info() << local_address_port(*_socket) << " Local removed, now " << this->m_local_sockets.size() << " connections");
-      delete _socket; // NB!! This is not really the right way. Explore passing the shared_ptr as a parameter instead.
+      hostsocket.reset(new LocalHostSocket(*this, this->m_io_service));
    }
+   return std::shared_ptr<LocalHostSocket>(hostsocket.release(), [this](LocalHostSocket *_hostsocket){ this->recycle(_hostsocket); });
+}
 
-   // Unconditionally we start looking for the next socket.
-   if ( this->mp_io_service != NULL && this->mp_acceptor != NULL && this->m_local_sockets.size() > 0)
+
+// The deleter of the consumers made by make_socket. Up to one more than the max connections are kept.
+void LocalHost::recycle(LocalHostSocket *_hostsocket)
+{
+   std::unique_ptr<LocalHostSocket> hostsocket(_hostsocket);
+   boost::system::error_code ec;
+   hostsocket->socket().close(ec);
+   std::lock_guard<std::mutex> lock(this->m_mutex_pool);
+   if (this->m_free_sockets.size() <= (size_t)std::max(this->m_max_connections, 0))
+   {
+      this->m_free_sockets.push_back(std::move(hostsocket));
+   }
+}
+
+
+// Runs the handlers of the operations aborted at the end of a connection cycle, so they let go of their consumers
+// before the io_service is used for the next one.
+void LocalHost::drain()
+{
+   this->m_io_service.restart();
+   for (;;)
    {
-      
-      boost::asio::ip::tcp::socket *new_socket = new boost::asio::ip::tcp::socket( *this->mp_io_service);
-      this->mp_acceptor->async_accept( *new_socket, boost::bind(&LocalHost::handle_accept, this, new_socket, boost::asio::placeholders::error));
+      try
+      {
+         this->m_io_service.poll();
+         break;
+      }
+      catch( std::exception &exc )
+      {
+         DOUT(info() << "Drain: " << exc.what());
+      }
    }
+   this->m_io_service.restart();
 }
 
 
@@ -340,7 +694,10 @@ void LocalHost::check_deadline(const boost::system::error_code& error)
    ASSERTE(this->m_pdeadline != nullptr, boost::system::errc::timed_out, "deadline timer out of scope");
    if (error == boost::asio::error::operation_aborted) // This will happen on every read / write that will reset the timer.
    {
-      this->m_pdeadline->async_wait(boost::bind(&LocalHost::check_deadline, this, boost::asio::placeholders::error));
+      if (this->m_pdeadline->expires_at() != boost::posix_time::pos_infin) // Unless disarmed by go_out.
+      {
+         this->m_pdeadline->async_wait(boost::bind(&LocalHost::check_deadline, this, boost::asio::placeholders::error));
+      }
       return;
    }
    bool expired = deadline_timer::traits_type::now() >= this->m_pdeadline->expires_at();
@@ -354,13 +711,13 @@ void LocalHost::check_deadline(const boost::system::error_code& error)
       this->remote_socket().lowest_layer().close(ec);
 
       this->m_pdeadline->expires_at(boost::posix_time::pos_infin);
-      if (!this->m_auto_reconnect)
+      if (!this->m_auto_reconnect && !this->m_hold_locals)
       {
          if (this->mp_io_service != nullptr)
          {
             this->mp_io_service->stop();
          }
-         this->interrupt();
+         this->shutdown_sockets();
 
          boost::system::error_code ec = make_error_code(boost::system::errc::timed_out);
          throw boost::system::system_error(ec);
@@ -375,10 +732,9 @@ void LocalHost::handle_handshake(const boost::system::error_code& error)
    if (!error)
    {
       this->dolog(info() + "Succesfull SSL handshake to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()));
-      {
-         this->m_pdeadline->expires_from_now(this->m_read_timeout);
-      }
-      this->remote_socket().async_read_some(boost::asio::buffer( m_remote_data, max_length), boost::bind(&LocalHost::handle_remote_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+      global.ssl_handshaked(this->remote_socket());
+      this->start_remote_read();
+      this->flush_gap();
    }
    else
    {
@@ -393,15 +749,94 @@ void LocalHost::go_out(boost::asio::io_service &io_service)
    try
    {
       io_service.reset();
+      // Consumers still waiting for a write to the previous remote connection resume reading. The data being written
+      // is lost, the data queued or gathered after it goes to the gap queue.
+      this->m_remote_busy = true;
+      this->m_remote_connected = false;
+      for (auto &item : this->m_remote_writes)
+      {
+         if (&item != &this->m_remote_writes.front())
+         {
+            this->queue_gap(item.first->data(), item.second);
+         }
+         if (item.first->socket().is_open())
+         {
+            item.first->start_read();
+         }
+      }
+      this->m_remote_writes.clear();
+      for (auto &sock : this->m_paused_sockets)
+      {
+         if (sock->socket().is_open())
+         {
+            sock->start_read();
+         }
+      }
+      this->m_paused_sockets.clear();
+      if (this->m_coalescer.pending() > 0)
+      {
+         this->queue_gap(this->m_coalescer.pending_data().data(), this->m_coalescer.pending());
+      }
+      this->m_coalescer.reset();
+      this->m_coalesce_armed = false;
+      this->m_coalesce_generation++;
+      boost::asio::deadline_timer coalesce_timer(io_service);
+      mylib::protect_pointer<boost::asio::deadline_timer> p_coalesce_timer( this->mp_coalesce_timer, coalesce_timer, this->m_mutex_base );
       boost::asio::deadline_timer deadline(io_service);
       mylib::protect_pointer<boost::asio::deadline_timer> p_deadline( this->m_pdeadline, deadline, this->m_mutex_base );
-      boost::asio::ssl::context ssl_context(boost::asio::ssl::context::tls);
-      global.set_ssl_context(ssl_context);
-      ssl_socket rem_socket( io_service, ssl_context );
+      auto ssl_context = global.ssl_context(ssl_role::client);
+      ssl_socket rem_socket( io_service, *ssl_context );
       mylib::protect_pointer<ssl_socket> p2( this->mp_remote_socket, rem_socket, this->m_mutex_base );
-
+      // However we leave, e.g. a handler throwing, the aborted remote operations must complete while the stream,
+      // its buffers and the timers still exist.
+      std::shared_ptr<void> ptr( NULL, [this, &rem_socket, &deadline, &coalesce_timer](void*)
+      {
+         boost::system::error_code ec;
+         rem_socket.lowest_layer().close(ec);
+         deadline.expires_at(boost::posix_time::pos_infin, ec);
+         coalesce_timer.cancel(ec);
+         this->drain();
+      });
+
+      // Starting with the randomly picked endpoint, the others are tried if it does not answer within the connector stagger.
+      // Endpoints the health monitor finds dead are tried last.
+      std::vector<int> indexes;
+      for (int index = 0; index < this->m_proxy_endpoints.size(); index++)
+      {
+         indexes.push_back((this->m_proxy_index + index) % this->m_proxy_endpoints.size());
+      }
+      global.m_health.prefer_alive(indexes, this->m_proxy_endpoints);
       this->dolog(info() + "Connecting to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()) );
-      boost::asio::socket_connect(rem_socket.lowest_layer(), io_service, this->remote_hostname(), this->remote_port() );
+      // The local consumers are served while connecting, their data goes to the gap queue.
+      const auto endpoints = connector::endpoints( this->m_proxy_endpoints, indexes );
+      // The attempts run on io_service too, so stop and interrupt see no half connected socket and are not kept waiting.
+      // Declared after ptr, so the attempts are cancelled before it drains.
+      connector connecting;
+      bool connect_done = false;
+      boost::system::error_code connect_error;
+      connecting.async_connect( io_service, endpoints, [&](const boost::system::error_code &_error, size_t _index, boost::asio::ip::tcp::socket &_connected)
+      {
+         connect_done = true;
+         connect_error = _error;
+         if (!_error)
+         {
+            std::lock_guard<std::mutex> l(this->m_mutex_base);
+            rem_socket.next_layer() = std::move(_connected);
+            this->m_proxy_index = indexes[_index];
+         }
+      });
+      while (!connect_done)
+      {
+         if (!this->m_thread.check_run())
+         {
+            throw std::runtime_error( "Stopped while connecting to remote host: " + this->remote_hostname() );
+         }
+         io_service.run_one_for(std::chrono::milliseconds(100));
+      }
+      if (connect_error)
+      {
+         throw boost::system::system_error(connect_error);
+      }
 
       this->dolog(info() + "Connected to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()) + " Attempting SSL handshake" );
       DOUT(info() << "handles: " << rem_socket.next_layer().native_handle() << " / " << rem_socket.lowest_layer().native_handle() );
@@ -411,13 +846,14 @@ void LocalHost::go_out(boost::asio::io_service &io_service)
       deadline.async_wait(boost::bind(&LocalHost::check_deadline, this, boost::asio::placeholders::error));
       deadline.expires_from_now(boost::posix_time::seconds(20));
       boost::system::error_code ec;
+      global.ssl_resume(rem_socket, this->remote_hostname() + ":" + mylib::to_string(this->remote_port()));
 #if 1
       rem_socket.async_handshake(boost::asio::ssl::stream_base::client, boost::bind(&LocalHost::handle_handshake, this, _1));
 #else
       rem_socket.handshake( boost::asio::ssl::stream_base::client, ec);
       this->dolog("Succesfull SSL handshake to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()) + " ec: " + OSS(ec));
       deadline.expires_from_now(this->m_read_timeout);
-      rem_socket.async_read_some(boost::asio::buffer( m_remote_data, max_length), boost::bind(&LocalHost::handle_remote_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+      rem_socket.async_read_some(this->m_remote_data.buffer(), boost::bind(&LocalHost::handle_remote_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
 #endif
       // Now let the io_service handle the session.
       DOUT(info() << "async_handshake started, now start ioservice");
@@ -433,44 +869,83 @@ void LocalHost::go_out(boost::asio::io_service &io_service)
          throw;
       }
    }
+   this->m_remote_connected = false;
+}
+
+
+// Serves the local consumers between the remote connection attempts, their data goes to the gap queue.
+void LocalHost::serve_locals(int _millisec)
+{
+   const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(_millisec);
+   this->m_io_service.restart();
+   while (this->m_thread.check_run() && std::chrono::steady_clock::now() < until)
+   {
+      try
+      {
+         this->m_io_service.run_one_for(std::chrono::milliseconds(100));
+      }
+      catch (std::exception &exc)
+      {
+         this->dolog(info() + "exception: " + exc.what() + " local count: " + OSS(this->m_local_sockets.size()));
+      }
+      if (this->m_local_sockets.empty())
+      {
+         throw std::runtime_error( "Local connection closed for " + mylib::to_string(this->m_local_port) );
+      }
+   }
 }
 
 
 void LocalHost::threadproc()
 {
+   mylib::protect_pointer<boost::asio::io_service> p_io_service( this->mp_io_service, this->m_io_service, this->m_mutex_base );
    while (this->m_thread.check_run())
    {
       // On start and after each lost connection we end up here.
       try
       {
          DOUT(info() << __FUNCTION__ << ":" << __LINE__);
-         boost::asio::io_service io_service;
-         mylib::protect_pointer<boost::asio::io_service> p_io_service( this->mp_io_service, io_service, this->m_mutex_base );
-
-         // We make this as a pointer because there may be more than one.
-         boost::asio::ip::tcp::socket *local_socket = new boost::asio::ip::tcp::socket(io_service);
-
-         // NB!! This will only support ipv4
-         boost::asio::ip::tcp::acceptor acceptor( io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), this->m_local_port) );
-
+         if (!this->m_acceptor || !this->m_acceptor->is_open())
+         {
+            // NB!! This will only support ipv4
+            this->m_acceptor.reset( new boost::asio::ip::tcp::acceptor( this->m_io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), this->m_local_port) ) );
+         }
+         boost::asio::ip::tcp::acceptor &acceptor(*this->m_acceptor);
          mylib::protect_pointer<boost::asio::ip::tcp::acceptor> p3( this->mp_acceptor, acceptor, this->m_mutex_base );
-         boost::asio::io_service::work session_work(io_service);
+         boost::asio::io_service::work session_work(this->m_io_service);
 
-         std::shared_ptr<void> ptr( NULL, [this](void*){ DOUT(info() << "local exit loop"); this->interrupt(); this->cleanup();} );
+         std::shared_ptr<void> ptr( NULL, [this, &acceptor](void*)
+         {
+            DOUT(info() << "local exit loop");
+            boost::system::error_code ec;
+            acceptor.cancel(ec);
+            this->shutdown_sockets();
+            this->cleanup();
+            this->drain();
+         });
          this->dolog(info() + "Waiting for local connection" );
 
          // Synchronous wait for connection from local TCP socket. Must be handled by the interrupt function
-         acceptor.accept( *local_socket );
-         auto p = std::make_shared<LocalHostSocket>(*this, local_socket);
-         this->m_local_sockets.push_back( p );  // NB!! redo by inserting line above directly
+         auto p = this->make_socket();
+         boost::system::error_code ec;
+         acceptor.accept( p->socket(), ec );
+         if (ec)
+         {
+            boost::system::error_code ec_close;
+            acceptor.close(ec_close); // Opened again on the next cycle.
+            throw boost::system::system_error(ec);
+         }
+         {
+            std::lock_guard<std::mutex> l(this->m_mutex_base);
+            this->m_local_sockets.push_back( p );
+         }
          this->m_local_connected = true;
 
-         boost::asio::socket_set_keepalive_to( *local_socket, std::chrono::seconds(20) );
-         local_socket->async_read_some( boost::asio::buffer( m_local_data, max_length), boost::bind(&LocalHostSocket::handle_local_read, p.get(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred) );
+         boost::asio::socket_set_keepalive_to( p->socket(), std::chrono::seconds(20) );
+         p->start_read();
 
-         // NB!! The following line may leak.... but only very slow.
-         boost::asio::ip::tcp::socket *new_socket = new boost::asio::ip::tcp::socket(io_service);
-         acceptor.async_accept( *new_socket, boost::bind(&LocalHost::handle_accept, this, new_socket, boost::asio::placeholders::error));
+         auto next = this->make_socket();
+         acceptor.async_accept( next->socket(), boost::bind(&LocalHost::handle_accept, this, next, boost::asio::placeholders::error));
 
          // Unstable. Uncertain about the actual cause. Does not work with either async or sync handshake.
          // io_service.run() terminates immediately, nothing (no handler) is called and no error code is returned.
@@ -486,10 +961,17 @@ void LocalHost::threadproc()
                std::uniform_int_distribution<> dis(0, this->m_proxy_endpoints.size()-1);
                this->m_proxy_index = dis(gen);
             }
-            this->go_out(io_service);
-            this->m_thread.sleep(5000);
+            this->go_out(this->m_io_service);
+            if (this->m_auto_reconnect || this->m_hold_locals)
+            {
+               this->serve_locals(5000);
+            }
+            else
+            {
+               this->m_thread.sleep(5000);
+            }
          }
-         while(this->m_auto_reconnect && this->m_thread.check_run() && !this->m_local_sockets.empty() && this->is_local_connected());
+         while((this->m_auto_reconnect || this->m_hold_locals) && this->m_thread.check_run() && !this->m_local_sockets.empty() && this->is_local_connected());
       }
       catch( std::exception &exc )
       {
@@ -498,5 +980,6 @@ void LocalHost::threadproc()
       this->m_local_connected = false;
       this->m_thread.sleep( 1500 ); //We will need some time to ensure the remote end has settled. May need to be investigated.
    }
+   this->m_acceptor.reset(); // The port is released while stopped.
+   this->drain();
 }
-
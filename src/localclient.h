@@ -22,6 +22,7 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/deadline_timer.hpp>
+#include <deque>
 
 #include "baseclient.h"
 
@@ -29,23 +30,58 @@
 class LocalHost;
 
 
-class LocalHostSocket
+// What to do with a local consumer when its outgoing queue is full.
+// drop:       The oldest queued chunk is dropped.
+// disconnect: The consumer is disconnected.
+// block:      Reading from the remote is paused until the consumer has room again.
+enum class lag_policy { drop, disconnect, block };
+
+lag_policy lag_policy_from_string(const std::string &_name);
+std::string to_string(lag_policy _policy);
+
+
+// A local consumer. It has its own read buffer and a bounded queue of the data received from the remote.
+// The data chunks are shared by all consumers.
+// Made by LocalHost::make_socket, when the last reference is gone it is recycled for the next consumer.
+class LocalHostSocket : public std::enable_shared_from_this<LocalHostSocket>
 {
 public:
 
-   LocalHostSocket(LocalHost &_host, boost::asio::ip::tcp::socket *_socket);
+   typedef std::shared_ptr<const std::string> chunk;
+
+   LocalHostSocket(LocalHost &_host, boost::asio::io_service &_io_service);
 
+   // Prepare a recycled consumer for a new connection.
+   void reset();
+
+   void start_read();
    void handle_local_read(const boost::system::error_code& error,size_t bytes_transferred);
 
+   // Queue data for the local consumer. Returns false if the consumer is lagging and should be disconnected.
+   bool send(const chunk &_chunk);
+   bool is_full() const;
+
+   const char *data() const { return this->m_read_buffer.data(); }
+
    boost::asio::ip::tcp::socket &socket();
 
    int id;
+   uint64_t m_dropped = 0;
    
    static int id_gen;
 
 protected:
 
-   boost::asio::ip::tcp::socket *m_socket;
+   void start_write();
+   void handle_local_write(const boost::system::error_code& error);
+
+   // The number of chunks waiting, i.e. not counting the one being written.
+   size_t pending() const { return this->m_queue.size() - (this->m_writing ? 1 : 0); }
+
+   boost::asio::ip::tcp::socket m_socket;
+   read_buffer m_read_buffer;
+   std::deque<chunk> m_queue; // The front element is the one being written while m_writing is set.
+   bool m_writing = false;
 
    LocalHost &m_host;
 };
@@ -55,7 +91,7 @@ class LocalHost : public BaseClient
 {
 public:
 
-   LocalHost(bool _active, mylib::port_type _local_port, mylib::port_type _activate_port, const std::vector<RemoteEndpoint> &_proxy_endpoints, const int _max_connections, PluginHandler &_plugin, const boost::posix_time::time_duration &_read_timeout, bool auto_reconnect);
+   LocalHost(bool _active, mylib::port_type _local_port, mylib::port_type _activate_port, const std::vector<RemoteEndpoint> &_proxy_endpoints, const int _max_connections, PluginHandler &_plugin, const boost::posix_time::time_duration &_read_timeout, bool auto_reconnect, const cppcms::json::value &_json);
    virtual ~LocalHost()
    {
       stop();
@@ -72,17 +108,31 @@ protected:
    void handle_local_read( LocalHostSocket &_hostsocket, const boost::system::error_code& error,size_t bytes_transferred);
    void handle_remote_read(const boost::system::error_code& error,size_t bytes_transferred);
 
-   void handle_local_write(boost::asio::ip::tcp::socket *_socket, const boost::system::error_code& error);
-   void handle_remote_write(int id, const boost::system::error_code& error);
+   void start_remote_read();
+   void resume_remote_read();
+   void queue_remote_write(const std::shared_ptr<LocalHostSocket> &_hostsocket, size_t bytes_transferred);
+   void start_remote_write();
+   void flush_remote(bool _force);
+   void handle_coalesce_timer(const boost::system::error_code& error, unsigned _generation);
+   void handle_remote_write(const boost::system::error_code& error);
+   void queue_gap(const char *_data, size_t _size);
+   void flush_gap();
+   void handle_gap_write(const std::shared_ptr<std::vector<LocalHostSocket::chunk>> &_chunks, const boost::system::error_code& error);
    void handle_handshake(const boost::system::error_code &err);
 
-   void remove_socket( boost::asio::ip::tcp::socket &_socket );
+   void remove_socket( LocalHostSocket &_hostsocket );
    bool is_local_connected() const;
    int local_user_count() const;
-   void handle_accept( boost::asio::ip::tcp::socket *_socket, const boost::system::error_code& error );
+   void handle_accept( const std::shared_ptr<LocalHostSocket> &_hostsocket, const boost::system::error_code& error );
+   void shutdown_sockets();
    void cleanup();
+   void drain();
+
+   std::shared_ptr<LocalHostSocket> make_socket();
+   void recycle(LocalHostSocket *_hostsocket);
 
    void go_out(boost::asio::io_service &io_service);
+   void serve_locals(int _millisec);
 
    std::vector<std::string> local_hostnames() const;
 
@@ -94,11 +144,41 @@ protected:
    boost::posix_time::ptime m_last_incoming_stamp, m_last_outgoing_stamp;
 
 
+   // The io_service and the acceptor are kept across the connection cycles of the thread.
+   boost::asio::io_service m_io_service;
+   std::unique_ptr<boost::asio::ip::tcp::acceptor> m_acceptor;
+
+   // Recycled consumers, with their sockets and read buffers. Destroyed before m_io_service.
+   std::mutex m_mutex_pool;
+   std::vector<std::unique_ptr<LocalHostSocket>> m_free_sockets;
+
    // These are used for RAII handling. They do not own anything and should not be assigned by new.
    boost::asio::io_service *mp_io_service = nullptr;
    boost::asio::deadline_timer *m_pdeadline = nullptr;
    boost::posix_time::time_duration m_read_timeout;
-   int m_write_count;
+
+   size_t m_queue_size = 64; // Max number of chunks queued per local consumer.
+   lag_policy m_lag_policy = lag_policy::block;
+   bool m_remote_busy = true; // Set while a remote read is pending or not possible, i.e. not connected.
+
+   // With "hold_locals" the local consumers stay connected when the remote connection is lost, and it is reconnected
+   // as long as they are. Meanwhile their data is kept in the gap queue, up to "gap_queue_size" bytes.
+   bool m_hold_locals = true;
+   bool m_remote_connected = false; // Set when the gap queue has been written after the handshake.
+   std::deque<LocalHostSocket::chunk> m_gap_queue;
+   size_t m_gap_queue_bytes = 0;
+   size_t m_gap_queue_size = 1024 * 1024;
+   uint64_t m_gap_dropped = 0;
+
+   // Local consumers with data in their read buffer waiting to be written to the remote. Served in order.
+   // Used when not coalescing.
+   std::deque<std::pair<std::shared_ptr<LocalHostSocket>, size_t>> m_remote_writes;
+
+   // Used when coalescing. Consumers wait here when the coalescer is full.
+   std::vector<std::shared_ptr<LocalHostSocket>> m_paused_sockets;
+   boost::asio::deadline_timer *mp_coalesce_timer = nullptr;
+   bool m_coalesce_armed = false;
+   unsigned m_coalesce_generation = 0; // Of the armed timer, a stale handler leaves m_coalesce_armed alone.
 
    bool m_local_connected = false;
    bool m_auto_reconnect = false; // If set the client UP will attempt to reconnect to server automatically.
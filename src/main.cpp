@@ -76,6 +76,7 @@ proxy_app::proxy_app(cppcms::service &srv) : cppcms::application(srv), timer_(sr
    dispatcher().assign("^/command/config/upload/(.*)$", &proxy_app::config_upload, this);
    dispatcher().assign("^/command/config/reload/(.*)$", &proxy_app::config_reload, this);
    dispatcher().assign("^/command/logfile/active=(.*)$", &proxy_app::log_file, this, 1);
+   dispatcher().assign("^/command/capture/name=(.*)&active=(.*)$", &proxy_app::capture_peer, this, 1, 2);
    dispatcher().assign("^/script/(.*)$", &proxy_app::script, this, 1);
    dispatcher().assign("^/status/(.*)$", &proxy_app::status_get, this);
    dispatcher().assign("^/logger/(.*)$", &proxy_app::logger_get, this);
@@ -105,17 +106,8 @@ void proxy_app::config_reload()
 
 void proxy_app::logger_get()
 {
-   int log_write_index = log().count();
    auto &data = global.get_session_data( this->session() );
-   for ( int index = data.m_logger_read_index; index < log_write_index; index++ )
-   {
-      std::string text = log().get(index);
-      if (!text.empty())
-      {
-         this->response().out() << text << std::endl;
-      }
-   }
-   data.m_logger_read_index = log_write_index;
+   this->response().out() << log().get_since( data.m_logger_read_index );
 }
 
 
@@ -186,7 +178,7 @@ void proxy_app::host_active(const std::string _param, const std::string _id, con
 void proxy_app::certificate_delete(const std::string certname)
 {
    DOUT(__FUNCTION__ << ": " << certname);
-   if (delete_certificate_file(my_certs_name, certname))
+   if (global.m_certificates.remove(certname))
    {
       if (global.client_certificate_exists(certname))
       {
@@ -197,7 +189,6 @@ void proxy_app::certificate_delete(const std::string certname)
       {
          log().add(OSS("Found matching host certificate " << certname));
       }
-      global.load_certificate_names(my_certs_name);
    }
    log().add("Completed deleting certificate " + certname);
 }
@@ -219,18 +210,14 @@ std::string proxy_app::status_get_json()
 
 void proxy_app::log_file(const std::string _param)
 {
-   global.m_log_all_data = _param == "true";
-   DOUT("Logfile: " << global.m_log_all_data << " from " << _param);
-   if (global.m_log_all_data)
-   {
-      global.m_in_data_log_file.open(global.m_log_path + "in_data.log");
-      global.m_out_data_log_file.open(global.m_log_path + "out_data.log");
-   }
-   else
-   {
-      global.m_in_data_log_file.close();
-      global.m_out_data_log_file.close();
-   }
+   DOUT("Logfile: " << _param);
+   global.m_capture.enable_all(_param == "true");
+}
+
+
+void proxy_app::capture_peer(const std::string _name, const std::string _param)
+{
+   global.m_capture.enable(_name, _param == "true");
 }
 
 
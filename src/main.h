@@ -74,6 +74,7 @@ public:
    void get_public_certificate(const std::string _param);
    void timeout_handle();
    void log_file(const std::string _param);
+   void capture_peer(const std::string _name, const std::string _param);
 
    static void setup_config( cppcms::json::value &_settings );
 
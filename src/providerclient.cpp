@@ -20,7 +20,9 @@
 #include <boost/bind.hpp>
 #include "proxy_global.h"
 #include "cppcms_util.h"
+#include "connector.h"
 #include <random>
+#include <limits>
 
 using boost::asio::ip::tcp;
 
@@ -39,6 +41,50 @@ ProviderClient::ProviderClient(bool _active, mylib::port_type _activate_port, co
       this->m_buffer_size = i*1024*1024;
    }
    cppcms::utils::check_bool(this->json, "use_buffer", this->m_use_buffer);
+   cppcms::utils::check_bool(this->json, "spool", this->m_use_spool);
+   cppcms::utils::check_int(this->json, "spool_size", this->m_spool_size);
+   cppcms::utils::check_int(this->json, "spool_segment", this->m_spool_segment);
+   cppcms::utils::check_int(this->json, "spool_age", this->m_spool_age);
+   if (this->m_use_spool)
+   {
+      ASSERTE(!this->m_local_endpoints.empty(), uniproxy::error::parse_file_failed, "spool requires a local endpoint");
+      ASSERTE(this->m_spool_size > 0, uniproxy::error::parse_file_failed, "Invalid spool_size, must be > 0 is: " + mylib::to_string(this->m_spool_size));
+      ASSERTE(this->m_spool_segment > 0 && this->m_spool_segment <= this->m_spool_size, uniproxy::error::parse_file_failed,
+              "Invalid spool_segment, must be > 0 and <= spool_size is: " + mylib::to_string(this->m_spool_segment));
+      ASSERTE(this->m_spool_age >= 0, uniproxy::error::parse_file_failed, "Invalid spool_age, must be >= 0 is: " + mylib::to_string(this->m_spool_age));
+   }
+   this->m_use_buffer |= this->m_use_spool; // The spool is fed from the buffer.
+   this->load_read_buffer(this->json);
+   this->m_coalescer.load_json(this->json);
+   this->m_ring.reset(new spsc_ring(this->m_use_buffer ? this->m_buffer_size : 1));
+}
+
+
+void ProviderClient::probe_targets(std::vector<health_monitor::target> &_targets) const
+{
+   BaseClient::probe_targets(_targets);
+   for (auto &ep : this->m_local_endpoints)
+   {
+      _targets.push_back({ep.m_hostname, ep.m_port, "local"});
+   }
+}
+
+
+cppcms::json::value ProviderClient::save_json_status()
+{
+   cppcms::json::value obj = BaseClient::save_json_status();
+   if (this->m_use_buffer)
+   {
+      obj["buffer"]["size"] = this->m_ring->capacity();
+      obj["buffer"]["overwritten"] = this->m_ring->overwritten();
+      obj["buffer"]["dropped"] = this->m_ring->dropped();
+   }
+   if (this->m_use_spool)
+   {
+      obj["spool"]["size"] = this->m_spool_bytes.load();
+      obj["spool"]["dropped"] = this->m_spool_dropped.load();
+   }
+   return obj;
 }
 
 
@@ -67,10 +113,7 @@ void ProviderClient::start()
 
 void ProviderClient::stop()
 {
-   {
-      std::lock_guard<std::mutex> lock(this->m_buffer_mutex);
-      this->m_buffer_condition.notify_one();
-   }
+   this->m_ring->notify();
    this->stop_activate();
    this->m_thread_write.stop();
    this->m_thread.stop();
@@ -79,8 +122,7 @@ void ProviderClient::stop()
 
 void ProviderClient::interrupt_writer()
 {
-   std::lock_guard<std::mutex> lovk(this->m_buffer_mutex);
-   this->m_buffer_condition.notify_one();
+   this->m_ring->notify();
 }
 
 
@@ -123,38 +165,118 @@ void ProviderClient::connect_remote(boost::asio::io_service &io_service, ssl_soc
       indexes[index] = index;
    }
    std::shuffle(std::begin(indexes), std::end(indexes), std::default_random_engine(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count())));
-   for (int index = 0; index < indexes.size(); index++)
+   std::vector<int> candidates;
+   for (int index : indexes)
    {
-      this->m_thread_write.check_run();
-      this->m_proxy_index = indexes[index]; // Get the next random connection.
-      std::string ep = this->remote_hostname() + ":" + mylib::to_string(this->remote_port());
-      if (global.certificate_available(this->m_proxy_endpoints[this->m_proxy_index].m_name))
+      if (global.certificate_available(this->m_proxy_endpoints[index].m_name))
       {
-         try
-         {
-            this->dolog("Performing remote connection to: " + ep );
-            boost::asio::socket_connect( remote_socket.lowest_layer(), io_service, remote_hostname(), this->remote_port());
-            break;
-         }
-         catch( std::exception &exc )
-         {
-            this->dolog("Failed connection to remote: " + ep + " " + exc.what());
-         }
+         candidates.push_back(index);
       }
       else
       {
-         DOUT(info() << "Ignored due to missing certificate: " << ep);
+         DOUT(info() << "Ignored due to missing certificate: " << this->m_proxy_endpoints[index].m_hostname << ":" << this->m_proxy_endpoints[index].m_port);
+      }
+   }
+   global.m_health.prefer_alive(candidates, this->m_proxy_endpoints);
+   this->m_thread_write.check_run();
+   if (!candidates.empty())
+   {
+      try
+      {
+         this->dolog("Performing remote connection to one of " + mylib::to_string(candidates.size()) + " endpoints");
+         this->m_proxy_index = candidates[connector().connect( remote_socket.next_layer(), connector::endpoints( this->m_proxy_endpoints, candidates ) )];
+      }
+      catch( std::exception &exc )
+      {
+         this->dolog(std::string("Failed connection to remote: ") + exc.what());
       }
    }
    ASSERTE(this->is_remote_connected(), uniproxy::error::socket_invalid,"Provider failed connection to remote host");
 
    boost::asio::socket_set_keepalive_to(remote_socket.lowest_layer(), std::chrono::seconds(20));
    this->dolog("Provider connected to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()) + " Attempting SSL handshake" );
+   global.ssl_resume(remote_socket, this->remote_hostname() + ":" + mylib::to_string(this->remote_port()));
    remote_socket.handshake(boost::asio::ssl::stream_base::client);
+   global.ssl_handshaked(remote_socket);
    this->dolog("Succesfull SSL handshake to remote host: " + this->remote_hostname() + ":" + mylib::to_string(this->remote_port()));
 }
 
 
+// The spool is placed in the log directory, which is not known before the configuration is loaded.
+void ProviderClient::open_spool()
+{
+   if (this->m_use_spool && !this->m_spool && !this->m_local_endpoints.empty())
+   {
+      std::string path = global.m_log_path + "spool_" + this->m_local_endpoints.front().m_hostname + "_" + mylib::to_string(this->m_local_endpoints.front().m_port) + "/";
+      try
+      {
+         this->m_spool.reset(new spool(path, (uint64_t)this->m_spool_size*1024*1024, (uint64_t)this->m_spool_segment*1024*1024, std::chrono::hours(this->m_spool_age)));
+         this->m_spool_bytes = this->m_spool->size();
+      }
+      catch(std::exception &exc)
+      {
+         DERR("Failed to open spool: " << path << " " << exc.what());
+         this->m_use_spool = false;
+      }
+   }
+}
+
+
+// Move everything in the ring to the end of the spool.
+void ProviderClient::spill()
+{
+   for (spsc_ring::span span = this->m_ring->claim(this->m_spool->max_record()); span.size > 0; span = this->m_ring->claim(this->m_spool->max_record()))
+   {
+      if (!this->m_spool->append(span.data, span.size))
+      {
+         DERR("Spool dropped: " << span.size);
+      }
+      this->m_ring->release(span);
+   }
+   this->m_spool_bytes = this->m_spool->size();
+   this->m_spool_dropped = this->m_spool->dropped();
+}
+
+
+// While the remote is not connected keep the ring from overflowing.
+void ProviderClient::spill_wait(int _timeout)
+{
+   const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout);
+   for (auto now = std::chrono::steady_clock::now(); this->m_thread_write.check_run() && now < until; now = std::chrono::steady_clock::now())
+   {
+      this->m_ring->wait(std::chrono::duration_cast<std::chrono::milliseconds>(until - now));
+      this->spill();
+   }
+}
+
+
+// Write the spool to the remote, oldest first. What arrives meanwhile is added to the spool to keep the order.
+// The read position is persisted for every MB and when the spool is empty.
+// With an empty spool nothing is done, the ring is then written directly.
+void ProviderClient::replay(ssl_socket &remote_socket)
+{
+   const char *data;
+   size_t size;
+   size_t uncommitted = 0;
+   for ( ; this->m_thread_write.check_run() && this->m_spool->front(data, size); this->spill())
+   {
+      BufferView view(data, size);
+      if ( this->m_plugin.local2remote( view ) )
+      {
+         int length = boost::asio::write(remote_socket, view.buffer());
+         this->m_count_out.add(length);
+      }
+      this->m_spool->pop();
+      if ((uncommitted += size) > 1024*1024)
+      {
+         this->m_spool->commit();
+         uncommitted = 0;
+      }
+   }
+   this->m_spool->commit();
+}
+
+
 void ProviderClient::threadproc_writer()
 {
    int timeout = 3000;
@@ -164,61 +286,68 @@ void ProviderClient::threadproc_writer()
       {
          DOUT(info() << "Provider writer start");
          this->m_count_out.clear();
+         this->open_spool();
          while(timeout < 10000)
             timeout += 1000;
 
          boost::asio::io_service io_service;
-         boost::asio::ssl::context ssl_context(boost::asio::ssl::context::tls);
-         global.set_ssl_context(ssl_context);
-         ssl_socket remote_socket( io_service, ssl_context );
+         auto ssl_context = global.ssl_context(ssl_role::client);
+         ssl_socket remote_socket( io_service, *ssl_context );
 
          mylib::protect_pointer<ssl_socket> p2( this->mp_remote_socket, remote_socket, this->m_mutex_base );
 
          this->connect_remote(io_service, remote_socket);
 
-         // This implementation uses the naive read some data and then write some data.
-         // Since the TCP stack is using buffers internally this should run reasonably efficient.
+         // The ring holds the reads back to back, so when coalescing we write everything contiguous in one go.
+         // Otherwise it is one write per read.
+         const size_t max_span = this->m_coalescer.enabled() ? std::numeric_limits<size_t>::max() : 0;
          for ( ; this->m_thread_write.check_run(); )
          {
+            if (this->m_spool)
             {
-               std::unique_lock<std::mutex> lk(this->m_buffer_mutex);
-               if (this->m_buffer_condition.wait_for(lk, std::chrono::seconds(60)) == std::cv_status::timeout)
-               {
-                  DOUT("Condition timed out");
-               }
+               this->replay(remote_socket);
+            }
+            if (!this->m_ring->wait(std::chrono::seconds(60)))
+            {
+               continue;
             }
-            std::string data;
-            do
+            if (this->m_coalescer.enabled() && this->m_coalescer.delay_ms() > 0)
             {
-               data.clear();
+               // Give the reader the chance to add some more before we write.
+               std::this_thread::sleep_for(std::chrono::milliseconds(this->m_coalescer.delay_ms()));
+            }
+            for (spsc_ring::span span = this->m_ring->claim(max_span); span.size > 0; span = this->m_ring->claim(max_span))
+            {
+               try
                {
-                  std::lock_guard<std::mutex> lk(this->m_buffer_mutex);
-                  if (!this->m_buffer.empty())
+                  BufferView view(span.data, span.size);
+                  if ( this->m_plugin.local2remote( view ) ) //, full ) )
                   {
-                     data = this->m_buffer.front();
-                     this->m_buffer.erase(this->m_buffer.begin());
+                     int length = boost::asio::write(remote_socket, view.buffer());
+                     this->m_count_out.add(length);
                   }
                }
-               if (!data.empty())
+               catch(std::exception &)
                {
-                  Buffer buffer((void*)data.data(), data.size());
-                  if ( this->m_plugin.message_filter_local2remote( buffer ) ) //, full ) )
-                  {
-                     // The plugin is allowed to modify the buffer, thus we need to recalculate size
-                     int length = remote_socket.write_some(boost::asio::buffer( buffer.m_buffer, buffer.m_size));
-
-                     this->m_count_out.add(length);
-                  }
-               }               
+                  this->m_ring->unclaim(span); // Keep it for the next connection.
+                  throw;
+               }
+               this->m_ring->release(span);
             }
-            while (!data.empty());
          }
       }
       catch(std::exception &exc)
       {
          DERR("Exception: " << exc.what());
       }
-      this->m_thread_write.sleep(timeout);
+      if (this->m_spool)
+      {
+         this->spill_wait(timeout);
+      }
+      else
+      {
+         this->m_thread_write.sleep(timeout);
+      }
    }
 }
 
@@ -258,21 +387,23 @@ void ProviderClient::threadproc_reader()
 
          boost::asio::ip::tcp::socket local_socket(io_service);
          mylib::protect_pointer<boost::asio::ip::tcp::socket> p1( this->mp_local_socket, local_socket, this->m_mutex_base );
-         std::string ep;
-         for ( int index = 0; index < this->m_local_endpoints.size(); index++ )
+         // In order of preference, a later endpoint is only used if the earlier do not answer within the connector stagger.
+         std::vector<int> indexes(this->m_local_endpoints.size());
+         for ( int index = 0; index < indexes.size(); index++ )
          {
-            ep = this->m_local_endpoints[index].m_hostname + ":" + mylib::to_string(this->m_local_endpoints[index].m_port);
-            try
-            {
-               this->dolog("Provider connecting to local: " + ep );
-               boost::asio::socket_connect( local_socket, io_service, this->m_local_endpoints[index].m_hostname, this->m_local_endpoints[index].m_port );
-               this->m_local_connected_index = index;
-               break;
-            }
-            catch( std::exception &exc )
-            {
-               DOUT(info() << __FUNCTION__ << ":" << __LINE__ << " Failed connection to: " << ep << " " << exc.what() );
-            }
+            indexes[index] = index;
+         }
+         global.m_health.prefer_alive(indexes, this->m_local_endpoints);
+         std::string ep = mylib::to_string(indexes.size()) + " endpoints";
+         try
+         {
+            this->dolog("Provider connecting to local: " + ep );
+            this->m_local_connected_index = connector().connect( local_socket, connector::endpoints( this->m_local_endpoints, indexes ) );
+            ep = this->m_local_endpoints[this->m_local_connected_index].m_hostname + ":" + mylib::to_string(this->m_local_endpoints[this->m_local_connected_index].m_port);
+         }
+         catch( std::exception &exc )
+         {
+            DOUT(info() << __FUNCTION__ << ":" << __LINE__ << " Failed connection to: " << ep << " " << exc.what() );
          }
          ASSERTE(this->is_local_connected(), uniproxy::error::socket_invalid,"Provider failed connection to local host: " + ep);
          boost::asio::socket_set_keepalive_to( local_socket, std::chrono::seconds(20) );
@@ -282,49 +413,67 @@ void ProviderClient::threadproc_reader()
             this->m_thread_write.start([this]{this->threadproc_writer();});
             while (this->m_thread.check_run())
             {
+               // Read directly into the ring, the writer gets the data as read, without copying.
+               // Only what has arrived is reserved, so a full ring only overwrites as much as is read.
+               local_socket.wait( tcp::socket::wait_read );
+               const size_t available = std::min( local_socket.available(), this->m_local_data.size() );
                int length;
-               length = local_socket.read_some( boost::asio::buffer( this->m_local_data, max_length-1 ) );
-
+               if (available == 0)
+               {
+                  length = local_socket.read_some( this->m_local_data.buffer() ); // The end of the stream.
+               }
+               else if (char *data = this->m_ring->prepare(available))
+               {
+                  length = local_socket.read_some( boost::asio::buffer(data, available) );
+                  global.m_capture.add(this->m_capture, this->remote_name(), capture::out, data, length);
+                  this->m_ring->commit(length);
+               }
+               else
+               {
+                  // The writer holds the oldest data, so this is dropped.
+                  length = local_socket.read_some( this->m_local_data.buffer() );
+               }
                if (length > 0)
                {
-                  this->m_local_data[length] = 0;
-                  std::lock_guard<std::mutex> lk(this->m_buffer_mutex);
-                  while (!this->m_buffer.empty() && this->m_buffer_count > this->m_buffer_size)
-                  {
-                     this->m_buffer_count -= this->m_buffer.front().size();
-                     this->m_buffer.erase(this->m_buffer.begin());
-                  }
-                  if (this->m_buffer.empty())
-                  {
-                     this->m_buffer_count = 0; // Just reset when we can.
-                  }
-                  this->m_buffer_count += length;
-                  this->m_buffer.push_back(this->m_local_data);
-                  this->m_buffer_condition.notify_one();
+                  this->m_local_data.update(length);
                }
             }
          }
          else
          {
-            boost::asio::ssl::context ssl_context(boost::asio::ssl::context::tls);
-            global.set_ssl_context(ssl_context);
-            ssl_socket remote_socket( io_service, ssl_context );
+            auto ssl_context = global.ssl_context(ssl_role::client);
+            ssl_socket remote_socket( io_service, *ssl_context );
             mylib::protect_pointer<ssl_socket> p2( this->mp_remote_socket, remote_socket, this->m_mutex_base );
             
             this->connect_remote(io_service, remote_socket);
+            this->m_coalescer.reset();
 
             while (this->m_thread.check_run())
             {
                int length;
-               length = local_socket.read_some( boost::asio::buffer( this->m_local_data, max_length-1 ) );
+               length = local_socket.read_some( this->m_local_data.buffer() );
                if (length > 0)
                {
-                  Buffer buffer((void*)this->m_local_data, length);
-                  if (this->m_plugin.message_filter_local2remote( buffer ))
+                  this->m_local_data.update(length);
+                  global.m_capture.add(this->m_capture, this->remote_name(), capture::out, this->m_local_data.data(), length);
+                  BufferView view(this->m_local_data.data(), length);
+                  if (this->m_plugin.local2remote( view ))
                   {
-                     // The plugin is allowed to modify the buffer, thus we need to recalculate size
-                     length = remote_socket.write_some(boost::asio::buffer(buffer.m_buffer, buffer.m_size));
-
+                     if (!this->m_coalescer.enabled())
+                     {
+                        // The plugin is allowed to modify the buffer, thus we need to recalculate size
+                        length = remote_socket.write_some(view.buffer());
+
+                        this->m_count_out.add(length);
+                        continue;
+                     }
+                     this->m_coalescer.append(view.data(), view.size());
+                  }
+                  // Gather only what is already waiting on the local socket, we do not wait for more.
+                  if (this->m_coalescer.pending() > 0 && (this->m_coalescer.full() || local_socket.available() == 0))
+                  {
+                     length = boost::asio::write(remote_socket, this->m_coalescer.take());
+                     this->m_coalescer.written();
                      this->m_count_out.add(length);
                   }
                }
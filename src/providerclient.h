@@ -23,6 +23,8 @@
 #include <boost/asio/ssl.hpp>
 
 #include "baseclient.h"
+#include "spsc_ring.h"
+#include "spool.h"
 
 
 class ProviderClient : public BaseClient
@@ -35,6 +37,9 @@ public:
          PluginHandler &_plugin, const cppcms::json::value &_json);
    virtual ~ProviderClient(){}
 
+   cppcms::json::value save_json_status();
+   void probe_targets(std::vector<health_monitor::target> &_targets) const;
+
 protected:
 
    void start();
@@ -47,6 +52,12 @@ protected:
 
    void connect_remote(boost::asio::io_service &io_service, ssl_socket &remote_socket);
 
+   // The disk spool, only used by the writer thread.
+   void open_spool();
+   void spill();
+   void spill_wait(int _timeout);
+   void replay(ssl_socket &remote_socket);
+
    bool is_local_connected() const;
    int local_user_count() const;
    std::string local_hostname() const;
@@ -62,13 +73,20 @@ public:
 protected:
 
 
-   std::mutex m_buffer_mutex;
-   std::condition_variable m_buffer_condition;
-   std::vector<std::string> m_buffer;
+   // Store and forward from the reader to the writer thread when m_use_buffer is set.
+   std::unique_ptr<spsc_ring> m_ring;
    std::size_t m_buffer_size = 1000000;
-   std::size_t m_buffer_count = 0;
    bool m_use_buffer = false;
 
+   // "spool" keeps what the ring cannot hold while the remote is unreachable on disk, also across restarts.
+   // Sizes are in MB and the age in hours.
+   std::unique_ptr<spool> m_spool;
+   bool m_use_spool = false;
+   int m_spool_size = 1024;
+   int m_spool_segment = 16;
+   int m_spool_age = 168;
+   std::atomic<uint64_t> m_spool_bytes{0}, m_spool_dropped{0};
+
    std::vector<LocalEndpoint> m_local_endpoints; // The list of local data providers to connect to in a round robin fashion.
    int m_local_connected_index = 0;
 
@@ -22,6 +22,7 @@
 #include <cppcms/view.h>
 #include "httpclient.h"
 #include <boost/filesystem.hpp>
+#include <openssl/evp.h>
 
 // From release.cpp
 extern const char * version;
@@ -58,6 +59,23 @@ void proxy_global::lock()
       }
    }
    this->m_activate_host.start(this->m_activate_port); // NB!! Hardcoded here...
+   this->m_health.start([this]
+   {
+      std::vector<health_monitor::target> targets;
+      std::lock_guard<std::mutex> l(this->m_mutex_list);
+      for (auto& host : this->remotehosts)
+      {
+         for (auto& ep : host->m_local_ep)
+         {
+            targets.push_back({ep.m_hostname, ep.m_port, "local"});
+         }
+      }
+      for (auto& client : this->localclients)
+      {
+         client->probe_targets(targets);
+      }
+      return targets;
+   });
 }
 
 
@@ -71,6 +89,7 @@ void proxy_global::unlock()
 
 void proxy_global::stopall()
 {
+   this->m_health.stop(); // It takes m_mutex_list.
    this->m_activate_host.stop(false);
    {
       std::lock_guard<std::mutex> l(this->m_mutex_list);
@@ -236,6 +255,15 @@ bool has_array(const cppcms::json::value &obj, const std::string &name)
 }
 
 
+// True if "coalesce_size" or "coalesce_delay" in the new configuration differ from the running ones.
+bool coalesce_changed(const write_coalescer &current, const cppcms::json::value &obj)
+{
+   write_coalescer coalesce;
+   coalesce.load_json(obj);
+   return current.limit() != coalesce.limit() || current.delay_ms() != coalesce.delay_ms();
+}
+
+
 bool proxy_global::is_same( const BaseClient &client, cppcms::json::value &obj1, bool &param_changed, bool &remotes_changed ) const
 {
    //NB!! This function does not currently work correctly if changing a port on the remote part.
@@ -274,6 +302,10 @@ bool proxy_global::is_same( const BaseClient &client, cppcms::json::value &obj1,
       {
          param_changed = true;
       }
+      if (coalesce_changed(client.coalescer(), obj1))
+      {
+         param_changed = true;
+      }
       result = true;
    }
    DOUT("Compare clients: " << client << " <=> " << obj1 << " result: " << result << " param: " << (int)param_changed << " remotes_changed: " << (int)remotes_changed);
@@ -342,6 +374,36 @@ bool proxy_global::is_same(const RemoteProxyHost &host, cppcms::json::value &obj
       {
          param_changed = true;
       }
+      if (host.engine() != session_engine_from_string(cppcms::utils::check_string(obj,"engine","",false)))
+      {
+         param_changed = true;
+      }
+      if (host.m_read_buffer_size != std::max(1, cppcms::utils::check_int(obj,"read_buffer_size",(int)host.m_plugin.max_buffer_size(),false)) ||
+          host.m_read_buffer_adaptive != cppcms::utils::check_bool(obj,"read_buffer_adaptive",false,false))
+      {
+         param_changed = true;
+      }
+      if (coalesce_changed(host.m_coalesce, obj))
+      {
+         param_changed = true;
+      }
+      balancer balance;
+      balance.load_json(obj);
+      if (host.m_balancer.policy() != balance.policy() || host.m_balancer.eject_failures() != balance.eject_failures() ||
+          host.m_balancer.eject_time() != balance.eject_time())
+      {
+         param_changed = true;
+      }
+      if (host.io_threads() != std::max(1, cppcms::utils::check_int(obj,"io_threads",1,false)) ||
+          host.acceptor_count() != std::max(1, cppcms::utils::check_int(obj,"acceptors",1,false)))
+      {
+         param_changed = true;
+      }
+      if (host.prewarm() != std::max(0, cppcms::utils::check_int(obj,"prewarm",0,false)) ||
+          host.prewarm_idle() != std::max(1, cppcms::utils::check_int(obj,"prewarm_idle",60,false)))
+      {
+         param_changed = true;
+      }
       result = true;
    }
    DOUT("Compare: " << host << " <=> " << obj << " result: " << (int)result << " param: " << (int)param_changed << " remote: " << (int)locals_changed)
@@ -507,7 +569,7 @@ void proxy_global::populate_json( cppcms::json::value &obj, int _json_acl )
          else if ( active && proxy_endpoints.size() > 0 )
          {
             // NB!! Search for the correct plugin version
-            baseclient_ptr local_ptr(new LocalHost(active, client_port, activate_port, proxy_endpoints, max_connections, standard_plugin, read_timeout, auto_reconnect));
+            baseclient_ptr local_ptr(new LocalHost(active, client_port, activate_port, proxy_endpoints, max_connections, standard_plugin, read_timeout, auto_reconnect, item1));
             this->localclients.push_back( local_ptr );
          } // NB!! What else if one of them is empty
       }
@@ -576,7 +638,7 @@ void proxy_global::populate_json( cppcms::json::value &obj, int _json_acl )
             }
             if ( remote_endpoints.size() > 0 && local_endpoints.size() > 0 )
             {
-               remotehost_ptr remote_ptr = std::make_shared<RemoteProxyHost>( host_port, remote_endpoints, local_endpoints, *plugin );
+               remotehost_ptr remote_ptr = std::make_shared<RemoteProxyHost>( host_port, remote_endpoints, local_endpoints, *plugin, item1 );
                this->remotehosts.push_back( remote_ptr );
             } // NB!! What else if one of them is empty
          }
@@ -595,6 +657,9 @@ void proxy_global::populate_json( cppcms::json::value &obj, int _json_acl )
       cppcms::utils::check_string( config_obj, "name", this->m_name );
       cppcms::utils::check_bool( config_obj, "debug", this->m_debug );
       cppcms::utils::check_string( config_obj, "log_path", global.m_log_path );
+      uniproxy::async_log::load_json( config_obj );
+      log().set_capacity( std::max( 1, cppcms::utils::check_int( config_obj, "log_history", 50, false ) ) );
+      this->m_capture.load_json( config_obj );
       cppcms::json::value proxies = config_obj.find( "uniproxies" );
       if (cppcms::utils::check_int( config_obj, "activate.timeout", i ))
       {
@@ -609,6 +674,9 @@ void proxy_global::populate_json( cppcms::json::value &obj, int _json_acl )
       cppcms::utils::check_port( config_obj, "activate.port", this->m_activate_port );
       cppcms::utils::check_int(config_obj, "min_tls_protocol", this->min_tls_protocol);
       cppcms::utils::check_bool(config_obj, "accept_short_certificates", this->accept_short_certs);
+      cppcms::utils::check_string(config_obj, "key_type", this->m_key_type);
+      this->m_health.load_json(config_obj);
+      ASSERTE(!openssl_newkey(this->m_key_type).empty(), uniproxy::error::parse_file_failed, "Invalid key_type, must be rsa2048, rsa3072, ec-p256 or ed25519 is: " + this->m_key_type);
       DOUT("min_tls_protocol: " << this->min_tls_protocol << " accept_short_certificates: " << this->accept_short_certs);
       ASSERTE(this->min_tls_protocol >= 12 && this->min_tls_protocol <= 13, uniproxy::error::parse_file_failed, OSS("Invalid TLS protocol, must be 12 r 13 is: " << this->min_tls_protocol));
 // NB!! Check if new uniproxies
@@ -691,7 +759,11 @@ std::string proxy_global::save_json_status( bool readable )
    }
    cppcms::json::object config_obj;
    config_obj["name"] = this->m_name;
+   config_obj["handshakes_full"] = this->m_handshakes_full.load();
+   config_obj["handshakes_resumed"] = this->m_handshakes_resumed.load();
    glob["global"] = config_obj;
+   glob["health"] = this->m_health.save_json_status();
+   glob["capture"] = this->m_capture.save_json_status();
    glob["version"] = version;
 
    std::ostringstream os;
@@ -700,6 +772,25 @@ std::string proxy_global::save_json_status( bool readable )
 }
 
 
+// The openssl req arguments for the key type, empty if unknown.
+std::string openssl_newkey(const std::string &_key_type)
+{
+   if (_key_type == "rsa2048" || _key_type == "rsa3072")
+   {
+      return "-newkey rsa:" + _key_type.substr(3);
+   }
+   if (_key_type == "ec-p256")
+   {
+      return "-newkey ec -pkeyopt ec_paramgen_curve:prime256v1";
+   }
+   if (_key_type == "ed25519")
+   {
+      return "-newkey ed25519";
+   }
+   return std::string();
+}
+
+
 bool proxy_global::execute_openssl()
 {
    std::string params;
@@ -708,7 +799,7 @@ bool proxy_global::execute_openssl()
 #endif
    int res = process::execute_process("openssl",
                                       " req " + params + "-x509 -nodes -days 100000 -subj /C=DK/ST=Denmark/L=GateHouse/CN=" +
-                                      this->m_name + " -newkey rsa:3072 -keyout my_private_key.pem -out my_public_cert.pem ",
+                                      this->m_name + " " + openssl_newkey(this->m_key_type) + " -keyout my_private_key.pem -out my_public_cert.pem ",
                                       [&](const std::string &_out)
                                       {
                                          DOUT(_out);
@@ -775,6 +866,12 @@ bool proxy_global::load_configuration()
             {
                log().add("Own name \"" + this->m_name + "\" does not match own certificate \"" + certificate_common_name + "\"");
             }
+            // An existing key is never replaced, the peers have the certificate.
+            if ( get_key_type(certs[0]) != this->m_key_type )
+            {
+               log().add("Own certificate key type " + get_key_type(certs[0]) + " differs from key_type " + this->m_key_type +
+                         ". Delete " + my_private_key_name + " and " + my_public_cert_name + " and activate again to change it");
+            }
          }
       }
       if ( ! (load_private && load_public) )
@@ -818,7 +915,7 @@ bool proxy_global::load_configuration()
          }
          this->populate_json(this->m_new_setup,proxy_global::all);
       }
-      this->load_certificate_names( my_certs_name );
+      this->m_certificates.load();
    }
    catch( std::exception &exc )
    {
@@ -902,27 +999,6 @@ void proxy_global::clean_session()
 }
 
 
-bool proxy_global::load_certificate_names( const std::string & _filename )
-{
-   std::lock_guard<std::mutex> lock(this->m_mutex_certificates);
-   std::string names;
-   bool result = false;
-   std::vector< certificate_type > certs;
-   m_cert_names.clear();
-   if ( load_certificates_file( _filename, certs ) )
-   {
-      for ( auto iter = certs.begin(); iter != certs.end(); iter++ )
-      {
-         m_cert_names.push_back( get_common_name( *iter ) );
-         names += "|" + get_common_name( *iter );
-      }
-      result = true;
-   }
-   DOUT("Load certificates from file: " << names );
-   return result;
-}
-
-
 std::string proxy_global::SetupCertificatesServer(boost::asio::ip::tcp::socket& _remote,
                                                   boost::asio::io_service& _io_service,
                                                   const std::vector<std::string>& _certnames)
@@ -945,7 +1021,7 @@ std::string proxy_global::SetupCertificatesServer(boost::asio::ip::tcp::socket&
 
       ASSERTE(load_certificates_string( buffer, remote_certs ) && remote_certs.size() == 1, uniproxy::error::certificate_invalid, "received");
       std::string remote_name = get_common_name( remote_certs[0] );
-      DOUT(info(_remote) << "Received certificate name: " << remote_name << " for connection: " << _certnames);
+      DOUT(info(_remote) << "Received certificate name: " << remote_name << " key type: " << get_key_type( remote_certs[0] ) << " for connection: " << _certnames);
       
       if (std::find(_certnames.begin(), _certnames.end(), remote_name) == _certnames.end())
       {
@@ -953,24 +1029,8 @@ std::string proxy_global::SetupCertificatesServer(boost::asio::ip::tcp::socket&
          return std::string();
       }
 
-      ASSERTE( load_certificates_file( my_certs_name, local_certs ), uniproxy::error::certificate_not_found,
-               std::string( " in file ") + my_certs_name + " for connection: " );
-
-      for ( auto iter = local_certs.begin(); iter != local_certs.end(); )
-      {
-         if ( remote_name == get_common_name( *iter ) )
-         {
-            DOUT(info(_remote) << "Removing old existing certificate name for replacement: " << remote_name);
-            iter = local_certs.erase( iter );
-         }
-         else
-         {
-            iter++;
-         }
-      }
-      local_certs.push_back( remote_certs[0] );
-      save_certificates_file( my_certs_name, local_certs );
-      this->load_certificate_names( my_certs_name );
+      // Replaces an existing certificate with the same name.
+      this->m_certificates.add( remote_certs[0] );
       return remote_name;
    }
    catch (std::exception& exc)
@@ -1009,10 +1069,20 @@ bool proxy_global::SetupCertificatesClient(boost::asio::ip::tcp::socket& _remote
 }
 
 
-bool proxy_global::certificate_available( const std::string &_cert_name)
+bool proxy_global::certificate_available( const std::string &_cert_name) const
 {
-   std::lock_guard<std::mutex> lock(this->m_mutex_certificates);
-   return std::find(this->m_cert_names.begin(), this->m_cert_names.end(), _cert_name ) != this->m_cert_names.end();
+   return this->m_certificates.contains( _cert_name );
+}
+
+
+void proxy_global::save_json_certificate( cppcms::json::object &_obj, const std::string &_cert_name ) const
+{
+   if (auto entry = this->m_certificates.find( _cert_name ))
+   {
+      _obj["cert"] = true;
+      _obj["cert_fingerprint"] = entry->fingerprint;
+      _obj["cert_expires"] = (int)(std::chrono::duration_cast<std::chrono::hours>(entry->expires - std::chrono::system_clock::now()).count() / 24);
+   }
 }
 
 static std::string get_password()
@@ -1073,6 +1143,181 @@ void proxy_global::set_ssl_context(boost::asio::ssl::context& ctx)
 }
 
 
+// The session ticket key is shared by the contexts and kept on disk, so tickets survive a restart.
+// It is replaced daily to limit what a leaked key exposes.
+// It is also replaced when forced, e.g. when the trusted certificates change.
+static void refresh_ticket_key(size_t _size, bool _force = false)
+{
+   boost::system::error_code ec;
+   std::time_t time = boost::filesystem::last_write_time(my_ticket_key_name, ec);
+   if (!_force && !ec && boost::filesystem::file_size(my_ticket_key_name, ec) == _size && !ec && std::time(nullptr) - time < 24*3600)
+   {
+      return;
+   }
+   std::vector<unsigned char> key(_size);
+   if (RAND_bytes(key.data(), (int)key.size()) != 1)
+   {
+      DERR("Failed to generate session ticket key");
+      return;
+   }
+   std::ofstream ofs(my_ticket_key_name + ".tmp", std::ios::binary | std::ios::trunc);
+   ofs.write((const char*)key.data(), key.size());
+   ofs.close();
+   boost::filesystem::permissions(my_ticket_key_name + ".tmp", boost::filesystem::owner_read | boost::filesystem::owner_write, ec);
+   boost::filesystem::rename(my_ticket_key_name + ".tmp", my_ticket_key_name, ec);
+   DOUT("New session ticket key: " << (ec ? ec.message() : "ok"));
+}
+
+
+// The SHA-256 of the trusted certificates. A session is only resumed with the same session id context, so a peer
+// whose certificate is deleted or replaced cannot resume a session from before.
+static std::string certs_digest()
+{
+   const std::string certs = readfile(my_certs_name);
+   unsigned char md[EVP_MAX_MD_SIZE];
+   unsigned int length = 0;
+   if (EVP_Digest(certs.data(), certs.size(), md, &length, EVP_sha256(), nullptr) != 1)
+   {
+      return "uniproxy";
+   }
+   return std::string((const char*)md, std::min<unsigned int>(length, SSL_MAX_SID_CTX_LENGTH));
+}
+
+
+// The modification time and size of the files, and the settings used by set_ssl_context.
+static std::string ssl_stamp(int _min_tls_protocol, ssl_role _role)
+{
+   std::ostringstream oss;
+   oss << _min_tls_protocol;
+   std::vector<std::string> filenames = { my_certs_name, my_public_cert_name, my_private_key_name };
+   if (_role == ssl_role::server)
+   {
+      filenames.push_back(my_ticket_key_name);
+   }
+   for (auto &filename : filenames)
+   {
+      boost::system::error_code ec1, ec2;
+      std::time_t time = boost::filesystem::last_write_time(filename, ec1);
+      boost::uintmax_t size = boost::filesystem::file_size(filename, ec2);
+      oss << ";" << (ec1 ? 0 : time) << ":" << (ec2 ? 0 : size);
+   }
+   return oss.str();
+}
+
+
+std::shared_ptr<boost::asio::ssl::context> proxy_global::ssl_context(ssl_role _role)
+{
+   std::lock_guard<std::mutex> l(this->m_ssl_mutex);
+   ssl_cache &cache = this->m_ssl_cache[_role == ssl_role::server ? 1 : 0];
+   const auto now = std::chrono::steady_clock::now();
+   if (cache.context && now - cache.checked < std::chrono::seconds(1))
+   {
+      return cache.context;
+   }
+   cache.checked = now;
+   if (_role == ssl_role::server && cache.context)
+   {
+      refresh_ticket_key(SSL_CTX_get_tlsext_ticket_keys(cache.context->native_handle(), nullptr, 0));
+   }
+   std::string stamp = ssl_stamp(this->min_tls_protocol, _role);
+   if (!cache.context || stamp != cache.stamp)
+   {
+      DOUT("Loading SSL context for: " << (_role == ssl_role::server ? "server" : "client") << " " << stamp);
+      auto context = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::tls);
+      this->set_ssl_context(*context);
+#ifdef _WIN32
+      if (_role == ssl_role::server)
+      {
+         // #if (OPENSSL_VERSION_NUMBER < 0x00905100L)
+         // By default it may be too low with a "no certificate returned" message.
+         // According to google this may be the cause (indeed it was on the test setup). The 4 should at least be >= 2. The define above is also from google. But that is not good enough.
+         SSL_CTX_set_verify_depth( context->native_handle(), 4 );
+      }
+#endif
+      SSL_CTX *ctx = context->native_handle();
+      if (_role == ssl_role::server)
+      {
+         // Required for resumption when the peer certificate is verified. The new context starts with an empty
+         // session cache, and when the trusted certificates changed the tickets issued before are not accepted.
+         const std::string digest = certs_digest();
+         SSL_CTX_set_session_id_context(ctx, (const unsigned char*)digest.data(), digest.size());
+         SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+         SSL_CTX_set_timeout(ctx, 24*3600);
+         const size_t size = SSL_CTX_get_tlsext_ticket_keys(ctx, nullptr, 0);
+         refresh_ticket_key(size, !cache.certs_digest.empty() && digest != cache.certs_digest);
+         cache.certs_digest = digest;
+         std::string key = readfile(my_ticket_key_name);
+         if (key.size() != size || SSL_CTX_set_tlsext_ticket_keys(ctx, (void*)key.data(), key.size()) != 1)
+         {
+            DERR("Using a random session ticket key, tickets do not survive a restart");
+         }
+         stamp = ssl_stamp(this->min_tls_protocol, _role);
+      }
+      else
+      {
+         // The sessions are kept per remote by ssl_new_session, not in the context.
+         SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+         SSL_CTX_sess_set_new_cb(ctx, &proxy_global::ssl_new_session);
+      }
+      // Sessions using the old one keeps it until they end.
+      cache.context = context;
+      cache.stamp = stamp;
+   }
+   return cache.context;
+}
+
+
+// The entry in m_ssl_sessions for the connection.
+static int ssl_session_index()
+{
+   static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+   return index;
+}
+
+
+void proxy_global::ssl_resume(ssl_socket &_socket, const std::string &_remote)
+{
+   std::lock_guard<std::mutex> l(this->m_ssl_mutex);
+   auto &entry = *this->m_ssl_sessions.emplace(_remote, nullptr).first;
+   SSL_set_ex_data(_socket.native_handle(), ssl_session_index(), &entry);
+   if (entry.second != nullptr)
+   {
+      SSL_set_session(_socket.native_handle(), entry.second);
+   }
+}
+
+
+// Called by OpenSSL when the remote sends a new session, with TLS 1.3 this is after the handshake.
+int proxy_global::ssl_new_session(SSL *_ssl, SSL_SESSION *_session)
+{
+   auto *entry = static_cast<std::pair<const std::string, SSL_SESSION*>*>(SSL_get_ex_data(_ssl, ssl_session_index()));
+   if (entry == nullptr)
+   {
+      return 0;
+   }
+   std::lock_guard<std::mutex> l(global.m_ssl_mutex);
+   if (entry->second != nullptr)
+   {
+      SSL_SESSION_free(entry->second);
+   }
+   entry->second = _session;
+   return 1; // We keep the reference.
+}
+
+
+void proxy_global::ssl_handshaked(ssl_socket &_socket)
+{
+   if (SSL_session_reused(_socket.native_handle()))
+   {
+      this->m_handshakes_resumed++;
+   }
+   else
+   {
+      this->m_handshakes_full++;
+   }
+}
+
+
 //-------------------------------------
 
 
@@ -1126,41 +1371,31 @@ void client_certificate_exchange::thread_proc( const std::vector<LocalEndpoint>
             bool result = httpclient::sync(host,"/json/command/certificate/get/",output);
             if (result)
             {
-               std::vector<certificate_type> own,remotes;
+               std::vector<certificate_type> added, remotes;
                ASSERTE(load_certificates_string(output, remotes), uniproxy::error::parse_file_failed, "Failed to load certificates from remote host");
                if (remotes.empty())
                {
                   continue;
                }
-               load_certificates_file(my_certs_name,own);
-               int ownsize = own.size();
+               auto own = global.m_certificates.get();
                for (auto rem : remotes)
                {
-                  bool ok = false;
-                  for (auto cert : own)
+                  auto it = own->find(get_common_name(rem));
+                  if (it != own->end())
                   {
-                     if (get_common_name(cert) == get_common_name(rem))
+                     // NB!! Check if cert are otherwise equal.
+                     if (!equal(it->second.cert,rem))
                      {
-                        ok = true;
-                        // NB!! Check if cert are otherwise equal.
-                        if (!equal(cert,rem))
-                        {
-                           DERR("Certificate with name: " << get_common_name(cert) << " has changed contents");
-                        }
+                        DERR("Certificate with name: " << it->first << " has changed contents");
                      }
                   }
-                  if (!ok)
+                  else
                   {
-                     DOUT("Adding cert: " << get_common_name(rem));
-                     own.push_back(rem);
+                     added.push_back(rem);
                      global.m_activate_host.remove(get_common_name(rem));
                   }
                }
-               if (ownsize != own.size())
-               {
-                  save_certificates_file(my_certs_name,own);
-                  global.load_certificate_names( my_certs_name );
-               }
+               global.m_certificates.add(added);
             }
             output = "";
             result = httpclient::sync(host,"/json/command/certificate/public/",output);
@@ -24,12 +24,18 @@
 #include "remoteclient.h"
 #include "localclient.h"
 #include "providerclient.h"
+#include "certificate_store.h"
+#include "health_monitor.h"
+#include "capture.h"
 #include <cppcms/application.h>
 
 
 typedef std::shared_ptr<BaseClient> baseclient_ptr;
 typedef std::shared_ptr<RemoteProxyHost> remotehost_ptr;
 
+// The hosts accept (server) and the clients connect (client).
+enum class ssl_role { client, server };
+
 
 class client_certificate_exchange : public mylib::thread
 {
@@ -165,6 +171,7 @@ public:
       this->m_activate_port = 25500;
       this->accept_short_certs = true;
       this->min_tls_protocol = 12;
+      this->m_key_type = "rsa3072";
    }
 
    // Own name to be used for generating own certificate.
@@ -174,17 +181,17 @@ public:
    session_data &get_session_data( cppcms::session_interface &_session );
    void clean_session();
 
-   // (common) Names from the certificates loaded from the imported certs.pem file.
-   std::mutex m_mutex_certificates;
-   std::vector<std::string> m_cert_names;
-   bool load_certificate_names( const std::string & _filename );
+   // The certificates imported to the certs.pem file, by common name.
+   certificate_store m_certificates{my_certs_name};
 
    bool SetupCertificatesClient(boost::asio::ip::tcp::socket& _remote_socket, const std::string& _connection_name);
    std::string SetupCertificatesServer(boost::asio::ip::tcp::socket& _remote_socket,
                                        boost::asio::io_service& _io_service,
                                        const std::vector<std::string>& _connection_names);
 
-   bool certificate_available( const std::string &_cert_name);
+   bool certificate_available( const std::string &_cert_name) const;
+   // Adds "cert", "cert_fingerprint" and "cert_expires" (days) when there is a certificate.
+   void save_json_certificate( cppcms::json::object &_obj, const std::string &_cert_name ) const;
    bool execute_openssl();
 
    bool is_same( const BaseClient &client, cppcms::json::value &obj, bool &param_changes, bool &client_changes ) const;
@@ -192,24 +199,52 @@ public:
 
    activate_host m_activate_host;
 
-   bool m_log_all_data = false;
+   // Background probes of the configured endpoints, the connect paths try the dead ones last.
+   health_monitor m_health;
 
-   std::ofstream m_out_data_log_file;
-   std::ofstream m_in_data_log_file;
+   // Traffic capture per peer, enabled from the web interface.
+   capture m_capture;
 
    std::string m_log_path = "log/";
 
    bool accept_short_certs = true;
    int min_tls_protocol = 12; // TLS v 1.3
+   std::string m_key_type = "rsa3072"; // For generating own certificate: rsa2048, rsa3072, ec-p256 or ed25519.
 
    void set_ssl_context(boost::asio::ssl::context& ctx);
 
+   // The shared context for the role. It is built once and replaced when the certificate files change,
+   // the sockets must keep the returned pointer while they live.
+   std::shared_ptr<boost::asio::ssl::context> ssl_context(ssl_role _role);
+
+   // TLS session resumption. Before the client handshake the last session for the remote is offered,
+   // the hosts have a session cache and issue tickets. Count the handshakes after they complete.
+   void ssl_resume(ssl_socket &_socket, const std::string &_remote);
+   void ssl_handshaked(ssl_socket &_socket);
+
+   std::atomic<uint64_t> m_handshakes_full{0}, m_handshakes_resumed{0};
+
 protected:
 
+   static int ssl_new_session(SSL *_ssl, SSL_SESSION *_session);
+
+   struct ssl_cache
+   {
+      std::shared_ptr<boost::asio::ssl::context> context;
+      std::string stamp;
+      std::string certs_digest; // Of my_certs_name, the session id context of the server.
+      std::chrono::steady_clock::time_point checked;
+   };
+   std::mutex m_ssl_mutex;
+   ssl_cache m_ssl_cache[2];
+   std::map<std::string, SSL_SESSION*> m_ssl_sessions; // The last session per remote hostname:port, entries are never removed.
+
    std::mutex m_session_data_mutex;
    std::vector< std::shared_ptr<session_data>> m_sessions;
 };
 
 extern proxy_global global;
 
+std::string openssl_newkey(const std::string &_key_type);
+
 #endif
@@ -21,13 +21,32 @@
 #include <boost/regex.hpp>
 #include <boost/algorithm/string/regex.hpp>
 #include "proxy_global.h"
-#include <random>
+#include "cppcms_util.h"
+#include "connector.h"
+#include <limits>
 
 using boost::asio::deadline_timer;
 
 static int static_remote_count = 0;
 
 
+session_engine session_engine_from_string(const std::string &_name)
+{
+   if (_name == "thread")
+   {
+      return session_engine::thread;
+   }
+   ASSERTE(_name.empty() || _name == "async", uniproxy::error::parse_file_failed, "Unknown session engine: " + _name);
+   return session_engine::async;
+}
+
+
+std::string to_string(session_engine _engine)
+{
+   return _engine == session_engine::thread ? "thread" : "async";
+}
+
+
 std::ostream & operator << (std::ostream & os, const RemoteProxyHost &host)
 {
    os << "[";
@@ -47,23 +66,30 @@ std::ostream & operator << (std::ostream & os, const RemoteProxyHost &host)
 
 /*
 When a connection is established a an instance of RemoteProxyClient is started.
-It will initiate 2 threads:
+With the thread engine it will initiate 2 threads:
  * 1 to handle reading from the connection to the local host
  * 1 to handle reading from the connection to the remote proxy
  *
  * When one of threads detects a socket disconnect it simply disconnect both sockets.
  *
+With the async engine no threads are started. The handshake and both directions are async chains on the
+host io_service, and only the blocking plugin logon is handed to the host logon pool.
+ *
  */
-RemoteProxyClient::RemoteProxyClient(boost::asio::io_service& io_service, boost::asio::ssl::context& context, RemoteProxyHost &_host )
-:  m_local_socket(io_service), m_remote_socket(io_service, context), 
+RemoteProxyClient::RemoteProxyClient(boost::asio::io_service& io_service, std::shared_ptr<boost::asio::ssl::context> context, RemoteProxyHost &_host )
+:  m_context(context), m_local_socket(io_service), m_remote_socket(io_service, *context), 
+   m_remote_read_buffer(_host.m_read_buffer_size, _host.m_read_buffer_adaptive),
+   m_local_read_buffer(_host.m_read_buffer_size, _host.m_read_buffer_adaptive),
    m_remote_thread( [&]{ this->interrupt(false); } ),
    m_local_thread( [&]{ this->interrupt(false); } ),
+   m_timer(io_service),
+   m_strand(io_service),
+   m_coalescer(_host.m_coalesce),
+   m_coalesce_timer(io_service),
    m_io_service(io_service),
    m_host(_host)
 {
    this->m_local_connected = this->m_remote_connected = false;
-   this->m_remote_read_buffer = new unsigned char[ this->m_host.m_plugin.max_buffer_size() + 1 ];
-   this->m_local_read_buffer = new unsigned char[ this->m_host.m_plugin.max_buffer_size() + 1 ];
 }
 
 
@@ -71,8 +97,6 @@ RemoteProxyClient::~RemoteProxyClient()
 {
    std::lock_guard<std::mutex> lock(this->m_mutex);
    DOUT(this->dinfo());
-   delete[] this->m_remote_read_buffer;
-   delete[] this->m_local_read_buffer;
 }
 
 
@@ -129,10 +153,25 @@ ssl_socket::lowest_layer_type& RemoteProxyClient::socket()
    return this->m_remote_socket.lowest_layer();
 }
 
+// Switch the not yet handshaken stream to a (newer) shared context.
+void RemoteProxyClient::set_context(std::shared_ptr<boost::asio::ssl::context> context)
+{
+   if (context && context != this->m_context)
+   {
+      SSL_set_SSL_CTX(this->m_remote_socket.native_handle(), context->native_handle());
+      this->m_context = context;
+   }
+}
+
 
 void RemoteProxyClient::start( std::vector<LocalEndpoint> &_local_ep )
 {
    this->m_local_ep = _local_ep;
+   if (this->m_host.engine() == session_engine::async)
+   {
+      this->start_async();
+      return;
+   }
    this->m_remote_thread.start( [&]{ this->remote_threadproc(); } );
 }
 
@@ -140,6 +179,10 @@ void RemoteProxyClient::start( std::vector<LocalEndpoint> &_local_ep )
 bool RemoteProxyClient::is_active()
 {
    std::lock_guard<std::mutex> lock(this->m_mutex);
+   if (this->m_async)
+   {
+      return this->thread_ended == std::chrono::system_clock::time_point();
+   }
    return this->m_local_thread.is_running() || this->m_remote_thread.is_running();
 }
 
@@ -149,6 +192,20 @@ void RemoteProxyClient::stop()
    // The threads are stopped and joined.
    if (this->m_stopped == std::chrono::system_clock::time_point())
    {
+      if (this->m_async)
+      {
+         // We may be called from any thread, so only the native sockets are shut down here.
+         // The pending async operations then fail and close the session in io_service context.
+         std::lock_guard<std::mutex> l(this->m_mutex);
+         if (this->m_local_socket.is_open())
+         {
+            shutdown(this->m_local_socket.native_handle(), boost::asio::socket_base::shutdown_both);
+         }
+         if (this->m_remote_socket.lowest_layer().is_open())
+         {
+            shutdown(this->m_remote_socket.lowest_layer().native_handle(), boost::asio::socket_base::shutdown_both);
+         }
+      }
       this->m_local_thread.stop();
       this->m_remote_thread.stop();
       this->m_stopped = std::chrono::system_clock::now();
@@ -174,6 +231,7 @@ void RemoteProxyClient::interrupt(bool synced)
       }
    }
    this->m_local_connected = this->m_remote_connected = false;
+   this->release_local();
 }
 
 
@@ -198,26 +256,31 @@ void RemoteProxyClient::local_threadproc()
          {
             int length;
             boost::system::error_code ec;
-            length = this->m_local_socket.read_some( boost::asio::buffer( this->m_local_read_buffer, this->m_host.m_plugin.max_buffer_size() ), ec );
+            length = this->m_local_socket.read_some( this->m_local_read_buffer.buffer(), ec );
             if (ec.value() != 0 || length == 0)
             {
                DOUT(this->dinfo() << "Local read socket Failed reading data " << ec.category().name() << " val: " << (int)ec.value() << " msg: " << ec.category().message(ec.value()) << " length: " << length);
                // This will show as a blob in journald. DOUT(this->dinfo() << "Last outgoing message: " << this->m_last_outgoing_stamp << ":" << this->m_last_outgoing_msg);
                break;
             }
-            this->m_local_read_buffer[length] = 0;
-            this->m_last_outgoing_stamp = boost::get_system_time();
-            this->m_last_outgoing_msg = (const char*)this->m_local_read_buffer;
-            if (global.m_out_data_log_file.is_open())
+            this->record_outgoing(length);
+            BufferView view( this->m_local_read_buffer.data(), length );
+            if ( this->m_host.m_plugin.local2remote( view ) )
             {
-               std::ofstream ofs(global.m_log_path + "out_" + this->m_endpoint.m_name + ".log", std::ios::ate | std::ios::app | std::ios::binary);
-               ofs << "[" << mylib::to_string(boost::get_system_time()) << "]" << this->m_local_read_buffer;
+               if ( !this->m_coalescer.enabled() )
+               {
+                  // The plugin is allowed to modify the buffer, thus we need to recalculate size
+                  length = this->m_remote_socket.write_some( view.buffer() );
+                  this->m_count_out.add(length);
+                  continue;
+               }
+               this->m_coalescer.append( view.data(), view.size() );
             }
-            Buffer buffer( this->m_local_read_buffer, length );
-            if ( this->m_host.m_plugin.message_filter_local2remote( buffer ) )
+            // Gather only what is already waiting on the local socket, this thread does not wait for more.
+            if ( this->m_coalescer.pending() > 0 && (this->m_coalescer.full() || this->m_local_socket.available(ec) == 0) )
             {
-               // The plugin is allowed to modify the buffer, thus we need to recalculate size
-               length = this->m_remote_socket.write_some( boost::asio::buffer( buffer.m_buffer, buffer.m_size ) );
+               length = boost::asio::write( this->m_remote_socket, this->m_coalescer.take() );
+               this->m_coalescer.written();
                this->m_count_out.add(length);
             }
          }
@@ -239,49 +302,20 @@ int RemoteProxyClient::test_local_connection(const std::string& name, const std:
    try
    {
       this->m_local_ep = _local_ep;
-      for (auto rep : this->m_host.m_remote_ep)
-      {
-         if (rep.m_name == name)
-         {
-            this->m_endpoint = rep;
-            break;
-         }
-      }
+      this->m_host.find_remote(name, this->m_endpoint);
       DOUT(this->dinfo() << "Test host, found remote connection: " << this->m_endpoint.m_name << " is connected locally? " << this->m_local_connected);
       if (this->m_local_connected)
       {
          return 429;
       }
-      this->m_local_connected = false;
-      std::vector<int> indexes(this->m_local_ep.size());
-      for (int index = 0; index < indexes.size(); index++)
-      {
-         indexes[index] = index;
-      }
-      std::shuffle(std::begin(indexes), std::end(indexes), std::default_random_engine(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count())));
-      for (int i = 0; i < indexes.size(); i++)
-      {
-         DOUT(this->dinfo() << "Test Host Random i: " << i << " index " << indexes[i] << " size: " << indexes.size());
-      }
       std::string ep;
-      for (int index = 0; index < this->m_local_ep.size(); index++)
+      try
       {
-         int proxy_index = indexes[index];
-         ep = this->m_local_ep[proxy_index].m_hostname + ":" + mylib::to_string(this->m_local_ep[proxy_index].m_port);
-         try
-         {
-            this->dolog(this->dinfo() + "Test Host Performing local connection to: " + ep );
-            boost::asio::socket_connect(this->m_local_socket, this->m_io_service, this->m_local_ep[proxy_index].m_hostname, this->m_local_ep[proxy_index].m_port);
-            this->m_local_connected = true;
-            break;
-         }
-         catch( std::exception &exc )
-         {
-            DOUT(this->dinfo() << " Failed connection to: " << ep << " " << exc.what() );
-         }
+         ep = this->connect_local(this->m_local_socket);
       }
-      if (!this->m_local_connected)
+      catch( std::exception &exc )
       {
+         DOUT(this->dinfo() << "Test Host " << exc.what());
          return 422;
       }
       try
@@ -300,6 +334,7 @@ int RemoteProxyClient::test_local_connection(const std::string& name, const std:
       }
       this->dolog(this->dinfo() + "Test Host done test logon procedure to " + ep);
       this->m_local_connected = false;
+      this->release_local();
       if (this->m_local_socket.is_open())
       {
          boost::system::error_code ec;
@@ -323,6 +358,121 @@ int RemoteProxyClient::test_local_connection(const std::string& name, const std:
 }
 
 
+void RemoteProxyClient::record_outgoing(size_t length)
+{
+   this->m_local_read_buffer.update(length);
+   this->m_local_read_buffer.data()[length] = 0;
+   this->m_last_outgoing_stamp = boost::get_system_time();
+   this->m_last_outgoing_msg = this->m_local_read_buffer.data();
+   global.m_capture.add(this->m_capture_out, this->m_endpoint.m_name, capture::out, this->m_local_read_buffer.data(), length);
+}
+
+
+void RemoteProxyClient::record_incoming(size_t length)
+{
+   this->m_remote_read_buffer.update(length);
+   this->m_remote_read_buffer.data()[length] = 0;
+   this->m_last_incoming_msg = this->m_remote_read_buffer.data();
+   this->m_last_incoming_stamp = boost::get_system_time();
+   global.m_capture.add(this->m_capture_in, this->m_endpoint.m_name, capture::in, this->m_remote_read_buffer.data(), length);
+}
+
+
+// Find the configured remote endpoint matching the certificate of the SSL connection.
+void RemoteProxyClient::find_endpoint()
+{
+   bool hit = false;
+   std::string common_name = "NOT VALID";
+   if ( get_certificate_common_name( this->m_remote_socket, common_name ) )
+   {
+      DOUT(this->dinfo() << "Received certificate CN= " << common_name );
+      hit = this->m_host.find_remote( common_name, this->m_endpoint );
+   }
+   if ( !hit )
+   {
+      throw std::runtime_error("Certificate valid but no active connections specified: " + common_name );
+   }
+}
+
+
+// Connect to one of the local endpoints in the order picked by the host balancer. Returns the endpoint as host:port.
+// The attempts overlap, so a dead endpoint only delays the connection by the connector stagger.
+std::string RemoteProxyClient::connect_local(boost::asio::ip::tcp::socket &_local)
+{
+   this->m_local_connected = false;
+   balancer &balance = this->m_host.m_balancer;
+   std::vector<int> indexes = balance.order(this->m_endpoint.m_name);
+   global.m_health.prefer_alive(indexes, this->m_local_ep);
+   std::vector<size_t> failed;
+   std::string ep;
+   try
+   {
+      int proxy_index = this->m_host.claim_local(_local, indexes);
+      if (proxy_index < 0)
+      {
+         this->dolog(this->dinfo() + "Performing local connection to one of " + mylib::to_string(indexes.size()) + " endpoints");
+         proxy_index = indexes[connector().connect( _local, connector::endpoints( this->m_local_ep, indexes ), &failed )];
+      }
+      ep = this->m_local_ep[proxy_index].m_hostname + ":" + mylib::to_string(this->m_local_ep[proxy_index].m_port);
+      balance.connected(proxy_index);
+      this->m_local_index = proxy_index;
+      this->m_local_connected = true;
+   }
+   catch( std::exception &exc )
+   {
+      DOUT(this->dinfo() << " Failed connection to local host: " << exc.what() );
+   }
+   for (size_t index : failed)
+   {
+      balance.failed(indexes[index]);
+   }
+   if ( !this->m_local_connected )
+   {
+      throw std::runtime_error("Failed connection to local host");
+   }
+   return ep;
+}
+
+
+// The session no longer counts on its local endpoint.
+void RemoteProxyClient::release_local()
+{
+   int index = this->m_local_index.exchange(-1);
+   if (index >= 0)
+   {
+      this->m_host.m_balancer.released(index);
+   }
+}
+
+
+// Everything between finding the endpoint of the SSL connection and the data transfer.
+// Blocking, the plugin connect_handler may wait for the local host for a while.
+std::string RemoteProxyClient::logon(boost::asio::ip::tcp::socket &_local)
+{
+   std::string ep = this->connect_local(_local);
+   this->dolog(this->dinfo() + "Performing logon procedure to " + ep);
+   const int local_index = this->m_local_index;
+   const auto start = std::chrono::steady_clock::now();
+   bool ok = false;
+   try
+   {
+      ok = this->m_host.m_plugin.connect_handler( _local, this->m_endpoint );
+   }
+   catch( std::exception & )
+   {
+      this->m_host.m_balancer.logon( local_index, false, std::chrono::milliseconds(0) );
+      throw;
+   }
+   this->m_host.m_balancer.logon( local_index, ok, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start) );
+   if ( !ok )
+   {
+      throw std::runtime_error("Failed plugin connect_handler for type: " + this->m_host.m_plugin.m_type );
+   }
+   this->dolog(this->dinfo() + "Completed logon procedure to " + ep);
+   return ep;
+}
+
+
 // Handle the remote SSL connection.
 void RemoteProxyClient::remote_threadproc()
 {
@@ -335,79 +485,18 @@ void RemoteProxyClient::remote_threadproc()
       }
       this->dolog(this->dinfo() + "Performing SSL hansdshake connection");
       this->m_remote_socket.handshake( boost::asio::ssl::stream_base::server );
+      global.ssl_handshaked(this->m_remote_socket);
       this->dolog(this->dinfo() + "SSL connection ok");
       this->m_remote_connected = true;
 
-      bool hit = false;
-      // See if we can find the relevant
-      std::string issuer, subject, common_name = "NOT VALID";
-      if ( get_certificate_issuer_subject( this->m_remote_socket, issuer, subject ) && issuer.length() > 0 )
-      {
-         std::vector< std::string > result;
-         boost::algorithm::split_regex( result, issuer, boost::regex( "/CN=" ) );
-         if ( result.size() > 1 )
-         {
-            common_name = result[1];
-         }
-         DOUT(this->dinfo() << "Received certificate CN= " << common_name );
-         for ( auto iter1 = this->m_host.m_remote_ep.begin(); iter1 != this->m_host.m_remote_ep.end(); iter1++ )
-         {
-            if ( common_name == (*iter1).m_name )
-            {
-               hit = true;
-               this->m_endpoint = (*iter1);
-               break;
-            }
-         }
-      }
-      if ( !hit )
-      {
-         throw std::runtime_error("Certificate valid but no active connections specified: " + common_name );
-      }
-      this->m_local_connected = false;
-      std::vector<int> indexes(this->m_local_ep.size());
-      for (int index = 0; index < indexes.size(); index++)
-      {
-         indexes[index] = index;
-      }
-      std::shuffle(std::begin(indexes), std::end(indexes), std::default_random_engine(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count())));
-      for (int i = 0; i < indexes.size(); i++)
-      {
-         DOUT(this->dinfo() << "Random i: " << i << " index " << indexes[i] << " size: " << indexes.size());
-      }
-      std::string ep;
-      for (int index = 0; index < this->m_local_ep.size(); index++)
-      {
-         int proxy_index = indexes[index];
-         ep = this->m_local_ep[proxy_index].m_hostname + ":" + mylib::to_string(this->m_local_ep[proxy_index].m_port);
-         try
-         {
-            this->dolog(this->dinfo() + "Performing local connection to: " + ep );
-            boost::asio::socket_connect( this->m_local_socket, this->m_io_service, this->m_local_ep[proxy_index].m_hostname, this->m_local_ep[proxy_index].m_port );
-            this->m_local_connected = true;
-            break;
-         }
-         catch( std::exception &exc )
-         {
-            DOUT(this->dinfo() << " Failed connection to: " << ep << " " << exc.what() );
-         }
-      }
-      if ( !this->m_local_connected )
-      {
-         throw std::runtime_error("Failed connection to local host");
-      }
-      this->dolog(this->dinfo() + "Performing logon procedure to " + ep);
-      if ( ! this->m_host.m_plugin.connect_handler( this->m_local_socket, this->m_endpoint ) )
-      {
-         throw std::runtime_error("Failed plugin connect_handler for type: " + this->m_host.m_plugin.m_type );
-      }
-      this->dolog(this->dinfo() + "Completed logon procedure to " + ep);
+      this->find_endpoint();
+      this->logon(this->m_local_socket);
       this->m_local_thread.start( [&]{this->local_threadproc(); } );
       boost::asio::socket_set_keepalive_to( this->m_remote_socket.lowest_layer(), std::chrono::seconds(20) );
       for ( ; this->m_remote_thread.check_run(); )
       {
          boost::system::error_code ec;
-         int length = this->m_remote_socket.read_some(boost::asio::buffer(this->m_remote_read_buffer, this->m_host.m_plugin.max_buffer_size()), ec);
+         int length = this->m_remote_socket.read_some(this->m_remote_read_buffer.buffer(), ec);
          if (ec.value() != 0 || length == 0)
          {
             DOUT(this->dinfo() << "Remote read socket Failed reading data " << ec.category().name() << " val: " << (int)ec.value() << " msg: " << ec.category().message(ec.value()) << " length: " << length);
@@ -416,18 +505,11 @@ void RemoteProxyClient::remote_threadproc()
          }
          if (length > 0)
          {
-            this->m_remote_read_buffer[length] = 0;
-            this->m_last_incoming_msg = (const char*)this->m_remote_read_buffer;
-            this->m_last_incoming_stamp = boost::get_system_time();
-            if (global.m_in_data_log_file.is_open())
-            {
-               std::ofstream ofs(global.m_log_path + "in_" + common_name + ".log", std::ios::ate | std::ios::app | std::ios::binary);
-               ofs << "[" << mylib::to_string(boost::get_system_time()) << "]" << this->m_remote_read_buffer;
-            }
-            Buffer buffer( this->m_remote_read_buffer, length );
-            if ( this->m_host.m_plugin.message_filter_remote2local( buffer ) )
+            this->record_incoming(length);
+            BufferView view( this->m_remote_read_buffer.data(), length );
+            if ( this->m_host.m_plugin.remote2local( view ) )
             {
-               length = this->m_local_socket.write_some( boost::asio::buffer( buffer.m_buffer, buffer.m_size ) );
+               length = this->m_local_socket.write_some( view.buffer() );
                this->m_count_in.add(length);
             }
             else
@@ -470,29 +552,340 @@ void RemoteProxyClient::remote_threadproc()
 }
 
 
-RemoteProxyHost::RemoteProxyHost(mylib::port_type local_port, const std::vector<RemoteEndpoint>& remote_ep, const std::vector<LocalEndpoint>& local_ep, PluginHandler& plugin)
+//-----------------------------------
+// The async engine
+
+
+void RemoteProxyClient::start_async()
+{
+   this->m_async = true;
+   DOUT(this->dinfo());
+   if ( this->m_local_ep.size() == 0 )
+   {
+      this->dolog(this->dinfo() + "No local endpoints found");
+      this->close_async();
+      return;
+   }
+   auto self(shared_from_this());
+   // The handshake and the logon must complete within the same time as the client allows for its handshake.
+   this->m_timer.expires_from_now(boost::posix_time::seconds(20));
+   this->m_timer.async_wait(boost::asio::bind_executor(this->m_strand, [this, self](const boost::system::error_code& error)
+   {
+      if (error != boost::asio::error::operation_aborted && !this->m_local_connected)
+      {
+         this->dolog(this->dinfo() + "Timeout on SSL handshake or logon");
+         this->close_async();
+      }
+   }));
+   this->dolog(this->dinfo() + "Performing SSL hansdshake connection");
+   this->m_remote_socket.async_handshake(boost::asio::ssl::stream_base::server, boost::asio::bind_executor(this->m_strand, [this, self](const boost::system::error_code& error)
+   {
+      this->handle_handshake(error);
+   }));
+}
+
+
+void RemoteProxyClient::handle_handshake(const boost::system::error_code& error)
+{
+   if (error)
+   {
+      std::ostringstream oss;
+      oss << "SSL: " << error << " what: " << error.message();
+      this->dolog(this->dinfo() + oss.str());
+      this->close_async();
+      return;
+   }
+   global.ssl_handshaked(this->m_remote_socket);
+   this->dolog(this->dinfo() + "SSL connection ok");
+   this->m_remote_connected = true;
+   try
+   {
+      this->find_endpoint();
+   }
+   catch( std::exception &exc )
+   {
+      this->dolog(this->dinfo() + exc.what());
+      this->close_async();
+      return;
+   }
+   auto self(shared_from_this());
+   boost::asio::post(this->m_host.logon_pool(), [this, self]{ this->logon_async(); });
+}
+
+
+// Runs on the host logon pool. The member sockets belong to the strand, so the local connection is made
+// on a socket of its own, which is handed over only if the session was not closed meanwhile.
+void RemoteProxyClient::logon_async()
+{
+   boost::asio::ip::tcp::socket local(this->m_io_service);
+   try
+   {
+      {
+         std::lock_guard<std::mutex> l(this->m_mutex);
+         ASSERTE(!this->m_logon_stopped && this->m_stopped == std::chrono::system_clock::time_point(), uniproxy::error::socket_invalid, "Session stopped before logon");
+      }
+      this->logon(local);
+      boost::asio::socket_set_keepalive_to( local, std::chrono::seconds(20) );
+      std::lock_guard<std::mutex> l(this->m_mutex);
+      ASSERTE(!this->m_logon_stopped, uniproxy::error::socket_invalid, "Session stopped during logon");
+      this->m_local_socket = std::move(local);
+   }
+   catch( boost::system::system_error &boost_error )
+   {
+      std::ostringstream oss;
+      oss << "SSL: " << boost_error.code() << " what: " << boost_error.what();
+      this->dolog(this->dinfo() + oss.str());
+      this->m_local_connected = false;
+      this->release_local();
+      boost::asio::post(this->m_strand, [self = shared_from_this()]{ self->close_async(); });
+      return;
+   }
+   catch( std::exception &exc )
+   {
+      this->dolog(this->dinfo() + exc.what());
+      this->m_local_connected = false;
+      this->release_local();
+      boost::asio::post(this->m_strand, [self = shared_from_this()]{ self->close_async(); });
+      return;
+   }
+   boost::asio::post(this->m_strand, [self = shared_from_this()]
+   {
+      if (self->thread_ended != std::chrono::system_clock::time_point())
+      {
+         return;
+      }
+      boost::system::error_code ec;
+      self->m_timer.cancel(ec);
+      boost::asio::socket_set_keepalive_to( self->m_remote_socket.lowest_layer(), std::chrono::seconds(20) );
+      self->start_local_read();
+      self->start_remote_read();
+   });
+}
+
+
+// Data sent from the host system to the client system.
+void RemoteProxyClient::start_local_read()
+{
+   auto self(shared_from_this());
+   this->m_local_socket.async_read_some(this->m_local_read_buffer.buffer(),
+      boost::asio::bind_executor(this->m_strand, [this, self](const boost::system::error_code& error, size_t length){ this->handle_local_read(error, length); }));
+}
+
+
+void RemoteProxyClient::handle_local_read(const boost::system::error_code& error, size_t length)
+{
+   if (error || length == 0)
+   {
+      DOUT(this->dinfo() << "Local read socket Failed reading data " << error << " msg: " << error.message() << " length: " << length);
+      this->close_async();
+      return;
+   }
+   this->record_outgoing(length);
+   BufferView view( this->m_local_read_buffer.data(), length );
+   if ( !this->m_host.m_plugin.local2remote( view ) )
+   {
+      this->start_local_read();
+      return;
+   }
+   if ( !this->m_coalescer.enabled() )
+   {
+      // The read buffer is not touched again until the write has completed, so it is written directly.
+      auto self(shared_from_this());
+      boost::asio::async_write(this->m_remote_socket, view.buffer(),
+         boost::asio::bind_executor(this->m_strand, [this, self, keep = view.rewritten()](const boost::system::error_code& error, size_t length){ this->handle_remote_write(error, length); }));
+      return;
+   }
+   this->m_coalescer.append( view.data(), view.size() );
+   if ( this->m_coalescer.full() )
+   {
+      this->m_local_paused = true;
+   }
+   else
+   {
+      this->start_local_read();
+   }
+   this->flush_remote(false);
+}
+
+
+// Write the gathered data unless a write is in progress, its completion will flush again.
+// Unless forced or full the write is delayed to gather some more.
+void RemoteProxyClient::flush_remote(bool _force)
+{
+   if ( this->m_coalescer.writing() || this->m_coalescer.pending() == 0 )
+   {
+      return;
+   }
+   auto self(shared_from_this());
+   if ( !_force && !this->m_coalescer.full() )
+   {
+      if ( !this->m_coalesce_armed )
+      {
+         this->m_coalesce_armed = true;
+         this->m_coalesce_timer.expires_from_now( this->m_coalescer.delay() );
+         this->m_coalesce_timer.async_wait(boost::asio::bind_executor(this->m_strand, [this, self, generation = ++this->m_coalesce_generation](const boost::system::error_code& error)
+         {
+            if ( error == boost::asio::error::operation_aborted || generation != this->m_coalesce_generation )
+            {
+               return;
+            }
+            this->m_coalesce_armed = false;
+            this->flush_remote(true);
+         }));
+      }
+      return;
+   }
+   boost::system::error_code ec;
+   this->m_coalesce_timer.cancel(ec);
+   this->m_coalesce_armed = false;
+   boost::asio::async_write(this->m_remote_socket, this->m_coalescer.take(),
+      boost::asio::bind_executor(this->m_strand, [this, self](const boost::system::error_code& error, size_t length){ this->handle_remote_write(error, length); }));
+}
+
+
+void RemoteProxyClient::handle_remote_write(const boost::system::error_code& error, size_t length)
+{
+   if (error)
+   {
+      DOUT(this->dinfo() << "Remote write failed " << error << " msg: " << error.message());
+      this->close_async();
+      return;
+   }
+   this->m_count_out.add(length);
+   if ( !this->m_coalescer.enabled() )
+   {
+      this->start_local_read();
+      return;
+   }
+   this->m_coalescer.written();
+   if ( this->m_local_paused )
+   {
+      this->m_local_paused = false;
+      this->start_local_read();
+   }
+   this->flush_remote(true);
+}
+
+
+// Data sent from the client system to the host system.
+void RemoteProxyClient::start_remote_read()
+{
+   auto self(shared_from_this());
+   this->m_remote_socket.async_read_some(this->m_remote_read_buffer.buffer(),
+      boost::asio::bind_executor(this->m_strand, [this, self](const boost::system::error_code& error, size_t length){ this->handle_remote_read(error, length); }));
+}
+
+
+void RemoteProxyClient::handle_remote_read(const boost::system::error_code& error, size_t length)
+{
+   if (error || length == 0)
+   {
+      DOUT(this->dinfo() << "Remote read socket Failed reading data " << error << " msg: " << error.message() << " length: " << length);
+      DOUT(this->dinfo() << "Last received msg: " << this->m_last_incoming_stamp << ":" << this->m_last_incoming_msg);
+      this->close_async();
+      return;
+   }
+   this->record_incoming(length);
+   BufferView view( this->m_remote_read_buffer.data(), length );
+   if ( this->m_host.m_plugin.remote2local( view ) )
+   {
+      auto self(shared_from_this());
+      boost::asio::async_write(this->m_local_socket, view.buffer(),
+         boost::asio::bind_executor(this->m_strand, [this, self, keep = view.rewritten()](const boost::system::error_code& error, size_t length){ this->handle_local_write(error, length); }));
+      return;
+   }
+   // This should not happen too often.
+   this->dolog(this->dinfo() + "Data overflow");
+   this->start_remote_read();
+}
+
+
+void RemoteProxyClient::handle_local_write(const boost::system::error_code& error, size_t length)
+{
+   if (error)
+   {
+      DOUT(this->dinfo() << "Local write failed " << error << " msg: " << error.message());
+      this->close_async();
+      return;
+   }
+   this->m_count_in.add(length);
+   this->start_remote_read();
+}
+
+
+// Closing the sockets makes any pending operation complete with an error, after which the handlers
+// (and with them the last references to the session) are released.
+// Notice we do not perform the SSL shutdown, it may linger if the remote end is gone, e.g. docker pause.
+void RemoteProxyClient::close_async()
+{
+   std::lock_guard<std::mutex> l(this->m_mutex);
+   if (this->thread_ended != std::chrono::system_clock::time_point())
+   {
+      return;
+   }
+   DOUT(this->dinfo() << "Session stopping");
+   this->m_logon_stopped = true;
+   boost::system::error_code ec;
+   this->m_timer.cancel(ec);
+   this->m_coalesce_timer.cancel(ec);
+   this->m_local_socket.shutdown(boost::asio::socket_base::shutdown_both, ec);
+   this->m_local_socket.close(ec);
+   this->m_remote_socket.lowest_layer().shutdown(boost::asio::socket_base::shutdown_both, ec);
+   this->m_remote_socket.lowest_layer().close(ec);
+   this->m_local_connected = this->m_remote_connected = false;
+   this->release_local();
+   this->thread_ended = std::chrono::system_clock::now();
+}
+
+
+RemoteProxyHost::RemoteProxyHost(mylib::port_type local_port, const std::vector<RemoteEndpoint>& remote_ep, const std::vector<LocalEndpoint>& local_ep, PluginHandler& plugin, const cppcms::json::value &_json)
 :  m_io_service(),
-   m_context(boost::asio::ssl::context::tls),
-   m_acceptor(m_io_service),
    m_plugin(plugin),
    m_local_port(local_port),
    m_thread([&](){this->interrupt();})
 {
-   global.set_ssl_context(m_context);
+   global.ssl_context(ssl_role::server); // Fail now if the certificates are missing.
    this->m_active = true;
    this->m_id = ++static_remote_count;
    this->m_remote_ep = remote_ep;
+   this->index_remotes();
    this->m_local_ep = local_ep;
-
-#ifdef _WIN32
-   // #if (OPENSSL_VERSION_NUMBER < 0x00905100L)
-   // By default it may be too low with a "no certificate returned" message.
-   // According to google this may be the cause (indeed it was on the test setup). The 4 should at least be >= 2. The define above is also from google. But that is not good enough.
-   SSL_CTX_set_verify_depth( this->m_context.native_handle(), 4 );
+   this->m_balancer.load_json(_json);
+   this->m_balancer.reset(this->m_local_ep);
+   std::string engine;
+   cppcms::utils::check_string(_json, "engine", engine);
+   this->m_engine = session_engine_from_string(engine);
+   cppcms::utils::check_int(_json, "logon_threads", this->m_logon_threads);
+   this->m_read_buffer_size = std::max(1, cppcms::utils::check_int(_json, "read_buffer_size", (int)plugin.max_buffer_size(), false));
+   cppcms::utils::check_bool(_json, "read_buffer_adaptive", this->m_read_buffer_adaptive);
+   this->m_coalesce.load_json(_json);
+   cppcms::utils::check_int(_json, "prewarm", this->m_prewarm);
+   cppcms::utils::check_int(_json, "prewarm_idle", this->m_prewarm_idle);
+   this->m_prewarm = std::max(0, this->m_prewarm);
+   this->m_prewarm_idle = std::max(1, this->m_prewarm_idle);
+   cppcms::utils::check_int(_json, "io_threads", this->m_io_threads);
+   cppcms::utils::check_int(_json, "acceptors", this->m_acceptor_count);
+   this->m_io_threads = std::max(1, this->m_io_threads);
+   this->m_acceptor_count = std::max(1, this->m_acceptor_count);
+#ifndef SO_REUSEPORT
+   if (this->m_acceptor_count > 1)
+   {
+      DERR(this->dinfo() << "SO_REUSEPORT not supported, using a single acceptor");
+      this->m_acceptor_count = 1;
+   }
 #endif
-   load_verify_file(this->m_context, my_certs_name);
-   this->m_context.use_certificate_chain_file(my_public_cert_name);
-   this->m_context.use_private_key_file(my_private_key_name, boost::asio::ssl::context::pem);
+   if (this->m_engine == session_engine::async)
+   {
+      this->m_logon_pool.reset(new boost::asio::thread_pool(std::max(1, this->m_logon_threads)));
+   }
+   DOUT(this->dinfo() << "Session engine: " << to_string(this->m_engine) << " io threads: " << this->m_io_threads << " acceptors: " << this->m_acceptor_count << " balance: " << to_string(this->m_balancer.policy()));
+}
+
+
+boost::asio::thread_pool &RemoteProxyHost::logon_pool()
+{
+   ASSERTE(this->m_logon_pool, uniproxy::error::socket_invalid, "No logon pool for the thread engine");
+   return *this->m_logon_pool;
 }
 
 
@@ -511,6 +904,7 @@ void RemoteProxyHost::add_remotes(const std::vector<RemoteEndpoint> &_remote_ep)
    {
       this->m_remote_ep.push_back(*iter);
    }
+   this->index_remotes();
 }
 
 
@@ -526,6 +920,33 @@ void RemoteProxyHost::remove_remotes(const std::vector<RemoteEndpoint> &_remote_
          this->m_remote_ep.erase(help);
       }
    }
+   this->index_remotes();
+}
+
+
+// The first remote with a name is used, as before with the linear search.
+void RemoteProxyHost::index_remotes()
+{
+   std::unordered_map<std::string, RemoteEndpoint> index;
+   for (auto &ep : this->m_remote_ep)
+   {
+      index.emplace(ep.m_name, ep);
+   }
+   std::lock_guard<std::mutex> l(this->m_mutex_remotes);
+   this->m_remote_index.swap(index);
+}
+
+
+bool RemoteProxyHost::find_remote(const std::string &_name, RemoteEndpoint &_endpoint) const
+{
+   std::lock_guard<std::mutex> l(this->m_mutex_remotes);
+   auto it = this->m_remote_index.find(_name);
+   if (it == this->m_remote_index.end())
+   {
+      return false;
+   }
+   _endpoint = it->second;
+   return true;
 }
 
 
@@ -572,11 +993,157 @@ void RemoteProxyHost::start()
    // In particular we want to ensure that we dont have 2 servers with the same port number.
    this->dolog(this->dinfo() + std::string("opening connection on port: ") + mylib::to_string(this->m_local_port));
    boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), this->m_local_port);
-   this->m_acceptor.open(ep.protocol());
-   this->m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(false));
-   this->m_acceptor.bind(ep);
-   DOUT(this->dinfo() << "Bind ok for " << ep);
+   this->m_acceptors.clear();
+#ifdef SO_REUSEPORT
+   // With SO_REUSEPORT our bind would succeed next to another server that has the option as well, so first probe the port
+   // without it. Only detects servers already listening, a process of the same user may still join the port later.
+   if (this->m_acceptor_count > 1)
+   {
+      boost::asio::ip::tcp::acceptor probe(this->m_io_service);
+      probe.open(ep.protocol());
+      probe.set_option(boost::asio::ip::tcp::acceptor::reuse_address(false));
+      probe.bind(ep);
+      probe.close();
+   }
+#endif
+   for (int index = 0; index < this->m_acceptor_count; index++)
+   {
+      std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor(new boost::asio::ip::tcp::acceptor(this->m_io_service));
+      acceptor->open(ep.protocol());
+      acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(false));
+#ifdef SO_REUSEPORT
+      if (this->m_acceptor_count > 1)
+      {
+         acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+      }
+#endif
+      acceptor->bind(ep);
+      this->m_acceptors.push_back(std::move(acceptor));
+   }
+   DOUT(this->dinfo() << "Bind ok for " << ep << " acceptors: " << this->m_acceptors.size());
    this->m_thread.start( [this]{ this->threadproc(); } );
+   if (this->m_prewarm > 0 && !this->m_prewarm_thread.is_running())
+   {
+      this->m_prewarm_thread.start( [this]{ this->threadproc_prewarm(); } );
+   }
+}
+
+
+// Keeps m_prewarm connections to the local endpoints open, in the order of the balancer.
+// Connections idle for more than m_prewarm_idle seconds are replaced, the local host may drop them.
+void RemoteProxyHost::threadproc_prewarm()
+{
+   DOUT(this->dinfo() << "Prewarming " << this->m_prewarm << " local connections");
+   for ( ; this->m_prewarm_thread.check_run(); )
+   {
+      {
+         std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+         const auto idle = std::chrono::steady_clock::now() - std::chrono::seconds(this->m_prewarm_idle);
+         while (!this->m_prewarmed.empty() && this->m_prewarmed.front().opened < idle)
+         {
+            this->m_prewarmed.pop_front();
+         }
+      }
+      for (;;)
+      {
+         {
+            std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+            if (this->m_prewarmed.size() >= this->m_prewarm)
+            {
+               break;
+            }
+         }
+         std::vector<int> indexes = this->m_balancer.order(std::string());
+         {
+            // Spread the pool over the endpoints.
+            std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+            std::vector<int> pooled(this->m_local_ep.size(), 0);
+            for (auto &item : this->m_prewarmed)
+            {
+               pooled[item.index]++;
+            }
+            for (int index = 0; index < pooled.size(); index++)
+            {
+               if (!this->m_balancer.available(index))
+               {
+                  pooled[index] = std::numeric_limits<int>::max();
+               }
+            }
+            std::stable_sort(indexes.begin(), indexes.end(), [&](int a, int b){ return pooled[a] < pooled[b]; });
+         }
+         global.m_health.prefer_alive(indexes, this->m_local_ep);
+         std::vector<size_t> failed;
+         prewarmed item;
+         item.socket.reset(new boost::asio::ip::tcp::socket(this->m_io_service));
+         try
+         {
+            item.index = indexes[connector(std::chrono::milliseconds(250), std::chrono::seconds(5)).connect( *item.socket, connector::endpoints( this->m_local_ep, indexes ), &failed )];
+         }
+         catch( std::exception &exc )
+         {
+            DOUT(this->dinfo() << "Prewarm failed: " << exc.what());
+         }
+         for (size_t index : failed)
+         {
+            this->m_balancer.failed(indexes[index]);
+         }
+         if (item.index < 0)
+         {
+            break;
+         }
+         boost::asio::socket_set_keepalive_to( *item.socket, std::chrono::seconds(20) );
+         item.opened = std::chrono::steady_clock::now();
+         std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+         this->m_prewarmed.push_back(std::move(item));
+      }
+      this->m_prewarm_thread.sleep(1000);
+   }
+}
+
+
+// Moves a prewarmed connection to _socket, the first one found in the order of _indexes.
+// Returns the local endpoint index or -1 if there is none.
+int RemoteProxyHost::claim_local(boost::asio::ip::tcp::socket &_socket, const std::vector<int> &_indexes)
+{
+   if (this->m_prewarm == 0)
+   {
+      return -1;
+   }
+   std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+   for (int index : _indexes)
+   {
+      for (auto iter = this->m_prewarmed.begin(); iter != this->m_prewarmed.end(); )
+      {
+         if (iter->index != index)
+         {
+            ++iter;
+            continue;
+         }
+         // Still open? Data waiting, e.g. a greeting, is left for the logon.
+         boost::system::error_code ec;
+         char peek;
+         iter->socket->non_blocking(true, ec);
+         iter->socket->receive(boost::asio::buffer(&peek, 1), boost::asio::socket_base::message_peek, ec);
+         if (ec && ec != boost::asio::error::would_block)
+         {
+            DOUT(this->dinfo() << "Prewarmed connection closed: " << ec.message());
+            iter = this->m_prewarmed.erase(iter);
+            continue;
+         }
+         iter->socket->non_blocking(false, ec);
+         // Both are on m_io_service, so the connection is simply moved.
+         _socket = std::move(*iter->socket);
+         this->m_prewarmed.erase(iter);
+         this->m_prewarm_hits++;
+         return index;
+      }
+      if (this->m_balancer.policy() == balance_policy::hash)
+      {
+         break; // Only the endpoint of the remote.
+      }
+   }
+   this->m_prewarm_misses++;
+   return -1;
 }
 
 
@@ -589,10 +1156,13 @@ void RemoteProxyHost::lock()
 void RemoteProxyHost::unlock()
 {
    DOUT(this->dinfo() << "unlock");
-   boost::system::error_code ec;
-   this->m_acceptor.cancel(ec);
-   shutdown(this->m_acceptor.native_handle(), boost::asio::socket_base::shutdown_both);
-   this->m_acceptor.close(ec);
+   for (auto &acceptor : this->m_acceptors)
+   {
+      boost::system::error_code ec;
+      acceptor->cancel(ec);
+      shutdown(acceptor->native_handle(), boost::asio::socket_base::shutdown_both);
+      acceptor->close(ec);
+   }
 }
 
 
@@ -601,11 +1171,11 @@ void RemoteProxyHost::threadproc()
    try
    {
       this->dolog(this->dinfo() + std::string("Waiting for remote connection on port: ") + mylib::to_string(this->m_local_port));
-      this->m_acceptor.listen();
-
-      RemoteProxyClient::pointer new_session = RemoteProxyClient::create(m_io_service, m_context, *this);
-      this->m_acceptor.async_accept(new_session->socket(),
-         boost::bind(&RemoteProxyHost::handle_accept, this, new_session, boost::asio::placeholders::error));
+      for (auto &acceptor : this->m_acceptors)
+      {
+         acceptor->listen();
+         this->start_accept(*acceptor);
+      }
 
       scope_exit se([this]
       {
@@ -623,7 +1193,17 @@ void RemoteProxyHost::threadproc()
             deadline.async_wait(boost::bind(&RemoteProxyHost::check_deadline, this, boost::asio::placeholders::error));
             deadline.expires_from_now(boost::posix_time::seconds(5));
 
-            this->m_io_service.run();
+            // The calling thread is one of the io threads.
+            std::vector<std::thread> workers;
+            for (int index = 1; index < this->m_io_threads; index++)
+            {
+               workers.emplace_back([this]{ this->run_io_service(); });
+            }
+            this->run_io_service();
+            for (auto &worker : workers)
+            {
+               worker.join();
+            }
          }
          catch( std::exception &exc )
          {
@@ -639,6 +1219,24 @@ void RemoteProxyHost::threadproc()
 }
 
 
+// An exception from a handler only ends the run of the thread it happened in, so we log it and continue.
+void RemoteProxyHost::run_io_service()
+{
+   for ( ; ; )
+   {
+      try
+      {
+         this->m_io_service.run();
+         return;
+      }
+      catch( std::exception &exc )
+      {
+         this->dolog(this->dinfo() + exc.what() );
+      }
+   }
+}
+
+
 void RemoteProxyHost::interrupt()
 {
    try
@@ -656,6 +1254,11 @@ void RemoteProxyHost::stop()
 {
    DOUT(this->dinfo() << "Stopping port: " << this->port());
    this->m_thread.stop();
+   this->m_prewarm_thread.stop();
+   {
+      std::lock_guard<std::mutex> l(this->m_mutex_prewarm);
+      this->m_prewarmed.clear();
+   }
    std::lock_guard<std::mutex> l(this->m_mutex);
    // Clean up the current client list and remove any non active clients.
    for (auto item : this->m_clients)
@@ -668,7 +1271,7 @@ void RemoteProxyHost::stop()
 
 int RemoteProxyHost::test_local_connection(const std::string& name)
 {
-   RemoteProxyClient test(this->m_io_service, this->m_context, *this);
+   RemoteProxyClient test(this->m_io_service, global.ssl_context(ssl_role::server), *this);
    return test.test_local_connection(name, this->m_local_ep);
 }
 
@@ -722,22 +1325,33 @@ void RemoteProxyHost::check_deadline(const boost::system::error_code& error)
    }
 }
 
+void RemoteProxyHost::start_accept(boost::asio::ip::tcp::acceptor &acceptor)
+{
+   RemoteProxyClient::pointer new_session = RemoteProxyClient::create(m_io_service, global.ssl_context(ssl_role::server), *this);
+   acceptor.async_accept(new_session->socket(),
+      boost::bind(&RemoteProxyHost::handle_accept, this, boost::ref(acceptor), new_session, boost::asio::placeholders::error));
+}
+
+
 // A new connection from a remote proxy is accepted
-//
-void RemoteProxyHost::handle_accept(RemoteProxyClient::pointer new_session, const boost::system::error_code& error)
+// With several io threads this may be called concurrently for different acceptors.
+void RemoteProxyHost::handle_accept(boost::asio::ip::tcp::acceptor &acceptor, RemoteProxyClient::pointer new_session, const boost::system::error_code& error)
 {
    try
    {
       DOUT(this->dinfo() << " error state " << error);
       if (!error)
       {
-         load_verify_file(this->m_context, my_certs_name);
-         this->m_clients.push_back( new_session );
+         // The context may have been reloaded (e.g. certs.pem changed) while the accept was pending.
+         new_session->set_context(global.ssl_context(ssl_role::server));
+         {
+            std::lock_guard<std::mutex> l(this->m_mutex);
+            this->m_clients.push_back( new_session );
+         }
          new_session->start( this->m_local_ep );
 
          // We create the next one, which is then waiting for a connection.
-         new_session = RemoteProxyClient::create(m_io_service, m_context,*this);
-         m_acceptor.async_accept(new_session->socket(),boost::bind(&RemoteProxyHost::handle_accept, this, new_session,boost::asio::placeholders::error));
+         this->start_accept(acceptor);
          return;
       }
       else
@@ -779,16 +1393,28 @@ cppcms::json::value RemoteProxyHost::save_json_status() const
    obj_host["port"] = this->port();
    obj_host["type"] = this->m_plugin.m_type;
    obj_host["active"] = this->m_active;
+   obj_host["balance"] = to_string(this->m_balancer.policy());
+   if (this->m_prewarm > 0)
+   {
+      std::lock_guard<std::mutex> l2(this->m_mutex_prewarm);
+      obj_host["prewarm"]["open"] = (int)this->m_prewarmed.size();
+      obj_host["prewarm"]["hits"] = (int)this->m_prewarm_hits.load();
+      obj_host["prewarm"]["misses"] = (int)this->m_prewarm_misses.load();
+   }
+   for (int index2 = 0; index2 < this->m_local_ep.size(); index2++)
+   {
+      cppcms::json::value obj = this->m_balancer.save_json_status(index2);
+      obj["hostname"] = this->m_local_ep[index2].m_hostname;
+      obj["port"] = this->m_local_ep[index2].m_port;
+      obj_host["locals"][index2] = obj;
+   }
 
    // Loop through each remote proxy
    for (int index2 = 0; index2 < this->m_remote_ep.size(); index2++)
    {
       cppcms::json::object obj;
       obj["name"] = this->m_remote_ep[index2].m_name;
-      if (global.certificate_available(this->m_remote_ep[index2].m_name))
-      {
-         obj["cert"] = true;
-      }
+      global.save_json_certificate(obj, this->m_remote_ep[index2].m_name);
       obj["hostname"] = this->m_remote_ep[index2].m_hostname;
 
       boost::posix_time::ptime timeout;
@@ -817,6 +1443,10 @@ cppcms::json::value RemoteProxyHost::save_json_status() const
                obj["remote_hostname"] = client.remote_endpoint().address().to_string(); // NB!! This one is dangerous
                obj["count_in"] = client.m_count_in.get();
                obj["count_out"] = client.m_count_out.get();
+               obj["ops_in"] = client.m_count_in.get_ops();
+               obj["ops_out"] = client.m_count_out.get_ops();
+               obj["rate_in"] = client.m_count_in.save_json_rates();
+               obj["rate_out"] = client.m_count_out.save_json_rates();
             }
             break;
          }
@@ -835,11 +1465,22 @@ cppcms::json::value RemoteProxyHost::save_json_config() const
    obj_host["port"] = this->port();
    obj_host["type"] = this->m_plugin.m_type;
    obj_host["active"] = this->m_active;
+   obj_host["engine"] = to_string(this->m_engine);
+   obj_host["io_threads"] = this->m_io_threads;
+   obj_host["acceptors"] = this->m_acceptor_count;
+   obj_host["read_buffer_size"] = this->m_read_buffer_size;
+   obj_host["read_buffer_adaptive"] = this->m_read_buffer_adaptive;
+   obj_host["coalesce_size"] = this->m_coalesce.limit();
+   obj_host["coalesce_delay"] = this->m_coalesce.delay_ms();
+   this->m_balancer.save_json_config(obj_host);
+   obj_host["prewarm"] = this->m_prewarm;
+   obj_host["prewarm_idle"] = this->m_prewarm_idle;
    for (int index2 = 0; index2 < this->m_local_ep.size(); index2++)
    {
       cppcms::json::object obj;
       obj["hostname"] = this->m_local_ep[index2].m_hostname;
       obj["port"] = this->m_local_ep[index2].m_port;
+      obj["weight"] = this->m_local_ep[index2].m_weight;
       obj_host["locals"][index2] = obj;
    }
    for (int index2 = 0; index2 < this->m_remote_ep.size(); index2++)
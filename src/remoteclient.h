@@ -20,9 +20,23 @@
 #define _remoteclient_h
 
 #include "applutil.h"
+#include "balancer.h"
+#include "capture.h"
+#include <deque>
 
 class RemoteProxyHost;
-   
+
+
+// How a RemoteProxyClient moves data once the session is established.
+// thread: A blocking thread per direction.
+// async:  Both directions are async read/write chains on the host io_service.
+// Selected per host with "engine", async is the default. PluginHandler::stream_local2remote is only
+// called by the thread engine, so plugins streaming the data themselves need "engine" : "thread".
+enum class session_engine { thread, async };
+
+session_engine session_engine_from_string(const std::string &_name);
+std::string to_string(session_engine _engine);
+
 
 //
 // This class handles connection from remote proxy clients
@@ -33,15 +47,16 @@ public:
 
    typedef boost::shared_ptr<RemoteProxyClient> pointer;
 
-   static pointer create(boost::asio::io_context& io_context, boost::asio::ssl::context& context, RemoteProxyHost &_host)
+   static pointer create(boost::asio::io_context& io_context, std::shared_ptr<boost::asio::ssl::context> context, RemoteProxyHost &_host)
    {
       return pointer(new RemoteProxyClient(io_context, context, _host));
    }
 
-   RemoteProxyClient(boost::asio::io_service& io_service, boost::asio::ssl::context& context, RemoteProxyHost &_host );
+   RemoteProxyClient(boost::asio::io_service& io_service, std::shared_ptr<boost::asio::ssl::context> context, RemoteProxyHost &_host );
    ~RemoteProxyClient();
 
    ssl_socket::lowest_layer_type& socket();
+   void set_context(std::shared_ptr<boost::asio::ssl::context> context);
 
    void start( std::vector<LocalEndpoint> &_local_ep );
    void stop();
@@ -50,6 +65,20 @@ public:
    // Clean up will be done when starting new threads or when checking deadline.
    void local_threadproc();
    void remote_threadproc();
+
+   // The async engine. The handshake and the data transfer run on the host io_service.
+   // Only the (blocking) plugin logon is performed on the host logon pool.
+   void start_async();
+   void handle_handshake(const boost::system::error_code& error);
+   void logon_async();
+   void start_local_read();
+   void handle_local_read(const boost::system::error_code& error, size_t length);
+   void handle_remote_write(const boost::system::error_code& error, size_t length);
+   void flush_remote(bool _force);
+   void start_remote_read();
+   void handle_remote_read(const boost::system::error_code& error, size_t length);
+   void handle_local_write(const boost::system::error_code& error, size_t length);
+   void close_async();
    
    bool is_active();
    bool is_local_connected();
@@ -64,12 +93,15 @@ public:
    void dolog( const std::string &_line );
 
    RemoteEndpoint m_endpoint;
+   std::shared_ptr<boost::asio::ssl::context> m_context; // Must outlive m_remote_socket.
    boost::asio::ip::tcp::socket m_local_socket;
    ssl_socket m_remote_socket;
    mutable std::mutex m_mutex;
 
    data_flow m_count_in, m_count_out;
 
+   capture::cache m_capture_in, m_capture_out; // The capture writer, for each direction as it may be read in its own thread.
+
    std::string m_last_incoming_msg, m_last_outgoing_msg;
    boost::posix_time::ptime m_last_incoming_stamp, m_last_outgoing_stamp;
 
@@ -94,13 +126,34 @@ protected:
 
    void interrupt(bool synced);
 
-   unsigned char *m_remote_read_buffer;
-   unsigned char *m_local_read_buffer;
+   // Shared by both engines. Throws on failure.
+   std::string logon(boost::asio::ip::tcp::socket &_local);
+   void find_endpoint();
+   std::string connect_local(boost::asio::ip::tcp::socket &_local);
+   void release_local();
+
+   void record_outgoing(size_t length);
+   void record_incoming(size_t length);
+
+   read_buffer m_remote_read_buffer;
+   read_buffer m_local_read_buffer;
 
    std::atomic<bool> m_local_connected, m_remote_connected;
+   std::atomic<bool> m_async{false};
 
    mylib::thread m_remote_thread, m_local_thread;
+   boost::asio::deadline_timer m_timer; // Handshake and logon timeout for the async engine.
+   boost::asio::io_service::strand m_strand; // The host io_service may be run by several threads, all async handlers go through here.
+
+   // Gathers the local data for the remote.
+   write_coalescer m_coalescer;
+   boost::asio::deadline_timer m_coalesce_timer;
+   bool m_coalesce_armed = false;
+   unsigned m_coalesce_generation = 0; // Of the armed timer, a stale handler leaves m_coalesce_armed alone.
+   bool m_local_paused = false; // The local read waits for the remote write to complete.
+   bool m_logon_stopped = false; // Set by close_async under m_mutex, the logon pool then drops its local connection.
    std::vector<LocalEndpoint> m_local_ep;
+   std::atomic<int> m_local_index{-1}; // The connected m_local_ep, as counted by the host balancer.
    boost::asio::io_service& m_io_service;
 
    std::chrono::system_clock::time_point m_stopped = std::chrono::system_clock::time_point();
@@ -116,7 +169,7 @@ class RemoteProxyHost
 {
 public:
 
-   RemoteProxyHost( mylib::port_type _local_port, const std::vector<RemoteEndpoint> &_remote_ep, const std::vector<LocalEndpoint> &_local_ep, PluginHandler &_plugin );
+   RemoteProxyHost( mylib::port_type _local_port, const std::vector<RemoteEndpoint> &_remote_ep, const std::vector<LocalEndpoint> &_local_ep, PluginHandler &_plugin, const cppcms::json::value &_json );
 
    void lock();
    void unlock();
@@ -134,6 +187,10 @@ public:
 
    void add_remotes(const std::vector<RemoteEndpoint> &_remote_ep);
    void remove_remotes(const std::vector<RemoteEndpoint> &_remote_ep);
+   // The remote endpoint with the certificate name.
+   bool find_remote(const std::string &_name, RemoteEndpoint &_endpoint) const;
+   // A prewarmed connection to one of the local endpoints, see "prewarm".
+   int claim_local(boost::asio::ip::tcp::socket &_socket, const std::vector<int> &_indexes);
    void stop_by_name(const std::string& certname);
 
    cppcms::json::value save_json_status() const;
@@ -144,18 +201,28 @@ public:
    void check_deadline(const boost::system::error_code& error);
    boost::asio::deadline_timer *m_pdeadline = nullptr;
 
+   session_engine engine() const { return this->m_engine; }
+   int io_threads() const { return this->m_io_threads; }
+   int acceptor_count() const { return this->m_acceptor_count; }
+   int prewarm() const { return this->m_prewarm; }
+   int prewarm_idle() const { return this->m_prewarm_idle; }
+   boost::asio::thread_pool &logon_pool();
+
 protected:
 
-   void handle_accept( RemoteProxyClient::pointer new_session, const boost::system::error_code& error);
+   void handle_accept( boost::asio::ip::tcp::acceptor &acceptor, RemoteProxyClient::pointer new_session, const boost::system::error_code& error);
+   void start_accept( boost::asio::ip::tcp::acceptor &acceptor );
 
    void interrupt();
    void threadproc();
+   void run_io_service();
+   void index_remotes();
+   void threadproc_prewarm();
 
 
    int m_id;
    boost::asio::io_service m_io_service;
-   boost::asio::ssl::context m_context;
-   boost::asio::ip::tcp::acceptor m_acceptor;
+   std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> m_acceptors; // More than one requires SO_REUSEPORT, the kernel then spreads the connections.
 
    std::string dinfo() const;
 
@@ -163,8 +230,13 @@ public: // NB!! These should be private
 
    PluginHandler &m_plugin;
    bool m_active;
+   size_t m_read_buffer_size;
+   bool m_read_buffer_adaptive = false;
+   write_coalescer m_coalesce;
+   session_engine m_engine = session_engine::async;
    std::vector<RemoteEndpoint> m_remote_ep; // static list loaded at start
    std::vector<LocalEndpoint> m_local_ep;
+   balancer m_balancer; // Picks the m_local_ep for each session.
 
 protected:
 
@@ -172,6 +244,15 @@ protected:
 
    mylib::thread m_thread;
 
+   // The number of threads running m_io_service and the number of acceptors listening on m_local_port.
+   // More than one acceptor uses SO_REUSEPORT, then another process of the same user can bind the port after we started
+   // and silently take a share of the connections.
+   int m_io_threads = 1;
+   int m_acceptor_count = 1;
+
+   // Used by the async engine for the plugin connect_handler, which is blocking.
+   int m_logon_threads = 4;
+   std::unique_ptr<boost::asio::thread_pool> m_logon_pool;
 
    // The following sections shall be protected by a gate
    mutable std::mutex m_mutex;
@@ -180,6 +261,24 @@ protected:
    mutable std::mutex m_mutex_log;
    std::string m_log;
 
+   // "prewarm" local connections are kept open ahead of the sessions, so they only have to run the logon.
+   struct prewarmed
+   {
+      std::unique_ptr<boost::asio::ip::tcp::socket> socket;
+      int index = -1; // In m_local_ep
+      std::chrono::steady_clock::time_point opened;
+   };
+   int m_prewarm = 0;
+   int m_prewarm_idle = 60; // Seconds
+   mutable std::mutex m_mutex_prewarm;
+   std::deque<prewarmed> m_prewarmed;
+   std::atomic<uint64_t> m_prewarm_hits{0}, m_prewarm_misses{0};
+   mylib::thread m_prewarm_thread{nullptr};
+
+   // m_remote_ep by name, updated with m_remote_ep.
+   mutable std::mutex m_mutex_remotes;
+   std::unordered_map<std::string, RemoteEndpoint> m_remote_index;
+
 };
 
 std::ostream & operator << (std::ostream & os, const RemoteProxyHost &host);
@@ -0,0 +1,322 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "spool.h"
+#include "applutil.h"
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+
+static uint32_t get_u32( const char *_data )
+{
+   uint32_t value;
+   memcpy( &value, _data, sizeof(value) );
+   return value;
+}
+
+
+static void put_u32( char *_data, uint32_t _value )
+{
+   memcpy( _data, &_value, sizeof(_value) );
+}
+
+
+static uint32_t crc32( const char *_data, size_t _size )
+{
+   boost::crc_32_type crc;
+   crc.process_bytes( _data, _size );
+   return crc.checksum();
+}
+
+
+spool::spool( const std::string &_path, uint64_t _max_size, uint64_t _segment_size, std::chrono::seconds _max_age )
+:  m_path(_path),
+   m_max_size(_max_size),
+   m_segment_size(std::max<uint64_t>(_segment_size, 64*1024)),
+   m_max_age(_max_age)
+{
+   this->load();
+}
+
+
+spool::~spool()
+{
+   try
+   {
+      this->commit();
+   }
+   catch( std::exception &exc )
+   {
+      DERR("Failed to save spool position: " << this->m_path << " " << exc.what());
+   }
+}
+
+
+std::string spool::filename( uint64_t _seq ) const
+{
+   std::ostringstream oss;
+   oss << this->m_path << std::hex << std::setw(16) << std::setfill('0') << _seq << ".seg";
+   return oss.str();
+}
+
+
+void spool::load()
+{
+   boost::filesystem::create_directories( this->m_path );
+   for ( auto &entry : boost::filesystem::directory_iterator(this->m_path) )
+   {
+      if ( entry.path().extension() != ".seg" )
+      {
+         continue;
+      }
+      uint64_t seq = 0;
+      std::istringstream iss( entry.path().stem().string() );
+      if ( !(iss >> std::hex >> seq) || seq == 0 )
+      {
+         continue;
+      }
+      try
+      {
+         segment &seg = this->open( seq, false );
+         this->m_segments[seq] = std::chrono::system_clock::time_point( std::chrono::seconds( get_u32(seg.file.const_data() + 8) ) );
+      }
+      catch( std::exception &exc )
+      {
+         DERR("Removing spool segment: " << entry.path().string() << " " << exc.what());
+         this->remove( seq );
+      }
+   }
+
+   std::ifstream ifs( this->m_path + "spool.pos" );
+   if ( !(ifs >> this->m_read_seq >> this->m_read_offset) || this->m_segments.count(this->m_read_seq) == 0 )
+   {
+      this->m_read_seq = this->m_segments.empty() ? 1 : this->m_segments.begin()->first;
+      this->m_read_offset = header_size;
+   }
+
+   if ( this->m_segments.empty() )
+   {
+      this->rotate();
+   }
+   else
+   {
+      // Find the end of the last segment and clear anything after it, it could be partially written.
+      segment &seg = this->open( this->m_segments.rbegin()->first, false );
+      while ( this->valid( seg, seg.end ) )
+      {
+         seg.end += record_header_size + get_u32( seg.file.const_data() + seg.end );
+      }
+      memset( seg.file.data() + seg.end, 0, seg.file.size() - seg.end );
+   }
+   this->close_unused();
+   DOUT("Spool: " << this->m_path << " segments: " << this->m_segments.size() << " read: " << this->m_read_seq << ":" << this->m_read_offset);
+}
+
+
+spool::segment &spool::open( uint64_t _seq, bool _create )
+{
+   auto it = this->m_open.find( _seq );
+   if ( it != this->m_open.end() )
+   {
+      return *it->second;
+   }
+   std::unique_ptr<segment> seg( new segment );
+   boost::iostreams::mapped_file_params params( this->filename(_seq) );
+   params.flags = boost::iostreams::mapped_file::readwrite;
+   if ( _create )
+   {
+      params.new_file_size = this->m_segment_size;
+   }
+   seg->file.open( params );
+   if ( _create )
+   {
+      put_u32( seg->file.data(), magic );
+      put_u32( seg->file.data() + 4, 1 );
+      put_u32( seg->file.data() + 8, static_cast<uint32_t>( std::chrono::duration_cast<std::chrono::seconds>( std::chrono::system_clock::now().time_since_epoch() ).count() ) );
+   }
+   ASSERTE( seg->file.size() > header_size && get_u32( seg->file.const_data() ) == magic, uniproxy::error::spool_invalid, this->filename(_seq) );
+   return *(this->m_open[_seq] = std::move(seg));
+}
+
+
+// Only the segments being read and written are kept mapped.
+void spool::close_unused()
+{
+   for ( auto it = this->m_open.begin(); it != this->m_open.end(); )
+   {
+      if ( it->first != this->m_read_seq && (this->m_segments.empty() || it->first != this->m_segments.rbegin()->first) )
+      {
+         it = this->m_open.erase(it);
+      }
+      else
+      {
+         ++it;
+      }
+   }
+}
+
+
+void spool::rotate()
+{
+   const uint64_t seq = this->m_segments.empty() ? this->m_read_seq : this->m_segments.rbegin()->first + 1;
+   this->open( seq, true );
+   this->m_segments[seq] = std::chrono::system_clock::now();
+   this->retention();
+   this->close_unused();
+}
+
+
+void spool::retention()
+{
+   const auto now = std::chrono::system_clock::now();
+   while ( this->m_segments.size() > 1 &&
+      (this->size() > this->m_max_size || (this->m_max_age.count() > 0 && now - this->m_segments.begin()->second > this->m_max_age)) )
+   {
+      const uint64_t seq = this->m_segments.begin()->first;
+      DOUT("Spool: " << this->m_path << " retention removes segment: " << seq);
+      if ( seq >= this->m_read_seq )
+      {
+         this->m_dropped++;
+      }
+      this->remove( seq );
+   }
+   if ( this->m_read_seq < this->m_segments.begin()->first )
+   {
+      this->m_read_seq = this->m_segments.begin()->first;
+      this->m_read_offset = header_size;
+      this->m_read_dirty = true;
+   }
+}
+
+
+void spool::remove( uint64_t _seq )
+{
+   this->m_open.erase( _seq );
+   this->m_segments.erase( _seq );
+   boost::system::error_code ec;
+   boost::filesystem::remove( this->filename(_seq), ec );
+}
+
+
+bool spool::valid( const segment &_seg, size_t _offset ) const
+{
+   if ( _offset + record_header_size > _seg.file.size() )
+   {
+      return false;
+   }
+   const char *header = _seg.file.const_data() + _offset;
+   const uint32_t length = get_u32( header );
+   return length > 0
+      && _offset + record_header_size + length <= _seg.file.size()
+      && get_u32( header + 4 ) == crc32( header + record_header_size, length );
+}
+
+
+bool spool::append( const char *_data, size_t _size )
+{
+   if ( _size == 0 )
+   {
+      return true;
+   }
+   if ( _size > this->max_record() )
+   {
+      return false;
+   }
+   segment *seg = &this->open( this->m_segments.rbegin()->first, false );
+   if ( seg->end + record_header_size + _size > seg->file.size() )
+   {
+      this->rotate();
+      seg = &this->open( this->m_segments.rbegin()->first, false );
+   }
+   char *header = seg->file.data() + seg->end;
+   memcpy( header + record_header_size, _data, _size );
+   put_u32( header + 4, crc32( _data, _size ) );
+   put_u32( header, static_cast<uint32_t>(_size) );
+   seg->end += record_header_size + _size;
+   return true;
+}
+
+
+bool spool::front( const char *&_data, size_t &_size )
+{
+   while ( !this->m_segments.empty() )
+   {
+      segment &seg = this->open( this->m_read_seq, false );
+      if ( this->valid( seg, this->m_read_offset ) )
+      {
+         _data = seg.file.const_data() + this->m_read_offset + record_header_size;
+         _size = get_u32( seg.file.const_data() + this->m_read_offset );
+         return true;
+      }
+      if ( this->m_read_seq == this->m_segments.rbegin()->first )
+      {
+         break; // Caught up with the writer.
+      }
+      // The segment is replayed, continue with the next.
+      const uint64_t seq = this->m_read_seq;
+      this->m_read_seq = std::next( this->m_segments.find(seq) )->first;
+      this->m_read_offset = header_size;
+      this->m_read_dirty = true;
+      this->commit();
+      this->remove( seq );
+   }
+   return false;
+}
+
+
+void spool::pop()
+{
+   // Only called after front() returned the record.
+   segment &seg = this->open( this->m_read_seq, false );
+   this->m_read_offset += record_header_size + get_u32( seg.file.const_data() + this->m_read_offset );
+   this->m_read_dirty = true;
+}
+
+
+void spool::commit()
+{
+   if ( !this->m_read_dirty )
+   {
+      return;
+   }
+   const std::string filename = this->m_path + "spool.pos";
+   {
+      std::ofstream ofs( filename + ".tmp", std::ios::trunc );
+      ofs << this->m_read_seq << " " << this->m_read_offset << std::endl;
+      ASSERTE( ofs.good(), uniproxy::error::spool_invalid, filename );
+   }
+   boost::filesystem::rename( filename + ".tmp", filename );
+   this->m_read_dirty = false;
+}
+
+
+bool spool::empty()
+{
+   const char *data;
+   size_t size;
+   return !this->front( data, size );
+}
+
+
+uint64_t spool::size() const
+{
+   return this->m_segments.size() * this->m_segment_size;
+}
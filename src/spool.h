@@ -0,0 +1,100 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _spool_h
+#define _spool_h
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+
+//
+// An append only disk spool of memory mapped segment files in a directory.
+//
+// Each segment starts with a header (magic and creation time) followed by records [length][crc32][payload].
+// A zero length ends the written part of a segment. The read position (segment and offset) is kept in
+// the file "spool.pos", which is replaced atomically, so after a restart the replay continues where it was.
+// A record with a bad checksum, e.g. a torn write at a crash, ends the segment.
+//
+// The oldest segments are deleted when the total size or the age limit is exceeded, also if not replayed.
+// The spool is not thread safe, it is owned by a single thread.
+//
+class spool
+{
+public:
+
+   spool( const std::string &_path, uint64_t _max_size, uint64_t _segment_size, std::chrono::seconds _max_age );
+   ~spool();
+
+   // Append a record. Returns false if it is too large for a segment.
+   bool append( const char *_data, size_t _size );
+
+   // The oldest record, false if the spool is empty.
+   bool front( const char *&_data, size_t &_size );
+   // Skip the front record returned by front().
+   void pop();
+   // Persist the read position.
+   void commit();
+
+   bool empty();
+   size_t max_record() const { return this->m_segment_size - header_size - record_header_size; }
+   uint64_t size() const;    // Bytes in segments on disk.
+   uint64_t dropped() const { return this->m_dropped; } // Segments deleted by retention before being replayed.
+   const std::string &path() const { return this->m_path; }
+
+private:
+
+   static const uint32_t magic = 0x4c505355; // USPL
+   static const size_t header_size = 16;
+   static const size_t record_header_size = 8;
+
+   struct segment
+   {
+      boost::iostreams::mapped_file file;
+      size_t end = header_size; // Write offset.
+   };
+
+   void load();
+   std::string filename( uint64_t _seq ) const;
+   segment &open( uint64_t _seq, bool _create );
+   void close_unused();
+   void rotate();
+   void retention();
+   void remove( uint64_t _seq );
+   bool valid( const segment &_seg, size_t _offset ) const;
+
+   std::string m_path;
+   uint64_t m_max_size;
+   uint64_t m_segment_size;
+   std::chrono::seconds m_max_age;
+
+   // The segments on disk and their creation time, the last one is written.
+   std::map<uint64_t, std::chrono::system_clock::time_point> m_segments;
+   std::map<uint64_t, std::unique_ptr<segment>> m_open;
+
+   uint64_t m_read_seq = 0;
+   size_t m_read_offset = header_size;
+   bool m_read_dirty = false;
+   uint64_t m_dropped = 0;
+};
+
+#endif
@@ -0,0 +1,175 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#include "spsc_ring.h"
+#include <algorithm>
+#include <cstring>
+
+
+spsc_ring::spsc_ring( size_t _bytes, size_t _records )
+:  m_data(new char[std::max<size_t>(_bytes, 1)]),
+   m_capacity(std::max<size_t>(_bytes, 1)),
+   m_record_count(_records > 0 ? _records : std::max<size_t>(_bytes / 64, 1024))
+{
+   this->m_records.reset(new record[this->m_record_count]);
+}
+
+
+bool spsc_ring::push( const char *_data, size_t _size )
+{
+   if ( _size == 0 )
+   {
+      return true;
+   }
+   char *data = this->prepare( _size );
+   if ( data == nullptr )
+   {
+      return false;
+   }
+   memcpy( data, _data, _size );
+   this->commit( _size );
+   return true;
+}
+
+
+char *spsc_ring::prepare( size_t _size )
+{
+   const uint64_t capacity = this->m_capacity;
+   if ( _size == 0 || _size > capacity )
+   {
+      this->m_dropped++;
+      return nullptr;
+   }
+   // A record does not wrap, so skip to the start of the ring if it does not fit before the end.
+   uint64_t pos = this->m_byte_head;
+   if ( pos % capacity + _size > capacity )
+   {
+      pos += capacity - pos % capacity;
+   }
+   const uint64_t head = this->m_head.load(std::memory_order_relaxed);
+   for ( ; ; )
+   {
+      uint64_t tail = this->m_tail.load(std::memory_order_acquire);
+      uint64_t oldest = tail & ~claimed;
+      if ( oldest == head || (pos + _size - this->m_records[oldest % this->m_record_count].pos <= capacity && head - oldest < this->m_record_count) )
+      {
+         break;
+      }
+      if ( tail & claimed )
+      {
+         // The consumer holds the oldest records.
+         this->m_dropped++;
+         return nullptr;
+      }
+      // Overwrite the oldest. Fails if the consumer claimed or released in the meantime, then we check again.
+      if ( this->m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel) )
+      {
+         this->m_overwritten++;
+      }
+   }
+   this->m_prepared = pos;
+   return this->m_data.get() + pos % capacity;
+}
+
+
+void spsc_ring::commit( size_t _size )
+{
+   if ( _size == 0 )
+   {
+      return;
+   }
+   const uint64_t head = this->m_head.load(std::memory_order_relaxed);
+   this->m_records[head % this->m_record_count] = record{ this->m_prepared, _size };
+   this->m_byte_head = this->m_prepared + _size;
+   this->m_head.store(head + 1, std::memory_order_seq_cst);
+   if ( this->m_waiting.load(std::memory_order_seq_cst) )
+   {
+      std::lock_guard<std::mutex> l(this->m_mutex);
+      this->m_condition.notify_one();
+   }
+}
+
+
+spsc_ring::span spsc_ring::claim( size_t _max )
+{
+   span result;
+   uint64_t tail = this->m_tail.load(std::memory_order_acquire);
+   uint64_t head;
+   do
+   {
+      head = this->m_head.load(std::memory_order_acquire);
+      if ( tail == head )
+      {
+         return result;
+      }
+   }
+   while ( !this->m_tail.compare_exchange_weak(tail, tail | claimed, std::memory_order_acq_rel) );
+
+   const uint64_t capacity = this->m_capacity;
+   const record &first = this->m_records[tail % this->m_record_count];
+   result.data = this->m_data.get() + first.pos % capacity;
+   result.first = tail;
+   uint64_t end = first.pos;
+   for ( uint64_t index = tail; index < head; index++ )
+   {
+      const record &r = this->m_records[index % this->m_record_count];
+      if ( result.count > 0 && (r.pos != end || end % capacity == 0 || result.size + r.size > _max) )
+      {
+         break; // Wrapped or enough.
+      }
+      end += r.size;
+      result.size += r.size;
+      result.count++;
+   }
+   return result;
+}
+
+
+void spsc_ring::release( const span &_span )
+{
+   this->m_tail.store(_span.first + _span.count, std::memory_order_release);
+}
+
+
+void spsc_ring::unclaim( const span &_span )
+{
+   this->m_tail.store(_span.first, std::memory_order_release);
+}
+
+
+bool spsc_ring::wait( std::chrono::milliseconds _timeout )
+{
+   std::unique_lock<std::mutex> l(this->m_mutex);
+   this->m_waiting.store(true, std::memory_order_seq_cst);
+   bool result = !this->empty() || this->m_condition.wait_for(l, _timeout) == std::cv_status::no_timeout;
+   this->m_waiting.store(false, std::memory_order_relaxed);
+   return result && !this->empty();
+}
+
+
+void spsc_ring::notify()
+{
+   std::lock_guard<std::mutex> l(this->m_mutex);
+   this->m_condition.notify_all();
+}
+
+
+bool spsc_ring::empty() const
+{
+   return (this->m_tail.load(std::memory_order_seq_cst) & ~claimed) == this->m_head.load(std::memory_order_seq_cst);
+}
@@ -0,0 +1,107 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Core application
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+#ifndef _spsc_ring_h
+#define _spsc_ring_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+
+//
+// A preallocated single producer / single consumer byte ring.
+// Data is stored as records, one per push, which are never split across the end of the ring,
+// so consecutive records form contiguous spans that can be written in one go.
+//
+// When full the oldest records are overwritten. Only while the consumer has claimed a span
+// the producer cannot overwrite, and new data is then dropped instead.
+//
+class spsc_ring
+{
+public:
+
+   struct span
+   {
+      const char *data = nullptr;
+      size_t size = 0;
+      uint64_t first = 0;   // The first record.
+      uint64_t count = 0;   // The number of records.
+   };
+
+   spsc_ring( size_t _bytes, size_t _records = 0 );
+
+   // Producer. Returns false if the data was dropped.
+   bool push( const char *_data, size_t _size );
+   // Producer, without a copy. Reserve room for up to _size bytes, e.g. to read into, nullptr if dropped.
+   // Then commit what was actually written there.
+   char *prepare( size_t _size );
+   void commit( size_t _size );
+
+   // Consumer. Claim a contiguous span of whole records of at most _max bytes, at least one record.
+   // The span is empty if there is no data.
+   span claim( size_t _max );
+   // The span has been consumed.
+   void release( const span &_span );
+   // The span could not be consumed, it is kept for the next claim.
+   void unclaim( const span &_span );
+
+   // Wait for data. Returns false on timeout or notify.
+   bool wait( std::chrono::milliseconds _timeout );
+   void notify();
+
+   bool empty() const;
+   size_t capacity() const { return this->m_capacity; }
+   uint64_t dropped() const { return this->m_dropped; }
+   uint64_t overwritten() const { return this->m_overwritten; }
+
+private:
+
+   struct record
+   {
+      uint64_t pos;  // Position in bytes since start, i.e. not wrapped.
+      size_t size;
+   };
+
+   static const uint64_t claimed = 1ULL << 63;
+
+   // Not initialized, so the pages are only committed as the ring is filled. Same for the records,
+   // by default one per 64 bytes, e.g. 256 MB for a 1000 MB ring.
+   std::unique_ptr<char[]> m_data;
+   size_t m_capacity;
+   std::unique_ptr<record[]> m_records;
+   size_t m_record_count;
+
+   // Record counters since start. The tail has the claimed bit set while the consumer holds a span.
+   std::atomic<uint64_t> m_head{0};
+   std::atomic<uint64_t> m_tail{0};
+   uint64_t m_byte_head = 0; // Producer only.
+   uint64_t m_prepared = 0;  // Producer only.
+
+   std::atomic<uint64_t> m_dropped{0};
+   std::atomic<uint64_t> m_overwritten{0};
+
+   std::mutex m_mutex;
+   std::condition_variable m_condition;
+   std::atomic<bool> m_waiting{false};
+};
+
+#endif
@@ -0,0 +1,169 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Handshake benchmark
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+//
+// Compares the TLS handshake cost of the config.key_type choices.
+// Client and server run in memory (BIO pairs) with mutual certificate verification as the proxy does,
+// so only the CPU cost is measured.
+//
+// Usage: uniproxy-handshake-bench [count] [tls version 12|13]
+//
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+
+#define CHECK( xx ) { if ( !(xx) ) throw std::runtime_error( std::string( #xx ) + " failed: " + ERR_error_string( ERR_get_error(), nullptr ) ); }
+
+
+static EVP_PKEY *generate_key( const std::string &_key_type )
+{
+   int id = EVP_PKEY_RSA;
+   if ( _key_type == "ec-p256" )
+   {
+      id = EVP_PKEY_EC;
+   }
+   else if ( _key_type == "ed25519" )
+   {
+      id = EVP_PKEY_ED25519;
+   }
+   std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx( EVP_PKEY_CTX_new_id( id, nullptr ), EVP_PKEY_CTX_free );
+   CHECK( ctx && EVP_PKEY_keygen_init( ctx.get() ) > 0 );
+   if ( id == EVP_PKEY_RSA )
+   {
+      CHECK( EVP_PKEY_CTX_set_rsa_keygen_bits( ctx.get(), std::stoi( _key_type.substr(3) ) ) > 0 );
+   }
+   else if ( id == EVP_PKEY_EC )
+   {
+      CHECK( EVP_PKEY_CTX_set_ec_paramgen_curve_nid( ctx.get(), NID_X9_62_prime256v1 ) > 0 );
+   }
+   EVP_PKEY *key = nullptr;
+   CHECK( EVP_PKEY_keygen( ctx.get(), &key ) > 0 );
+   return key;
+}
+
+
+// Self signed, as generated by proxy_global::execute_openssl.
+static X509 *generate_certificate( EVP_PKEY *_key, const std::string &_name )
+{
+   X509 *cert = X509_new();
+   X509_set_version( cert, 2 );
+   ASN1_INTEGER_set( X509_get_serialNumber( cert ), 1 );
+   X509_gmtime_adj( X509_getm_notBefore( cert ), 0 );
+   X509_gmtime_adj( X509_getm_notAfter( cert ), 3600 );
+   X509_set_pubkey( cert, _key );
+   X509_NAME *name = X509_get_subject_name( cert );
+   X509_NAME_add_entry_by_txt( name, "CN", MBSTRING_ASC, (const unsigned char*)_name.c_str(), -1, -1, 0 );
+   X509_set_issuer_name( cert, name );
+   // Ed25519 has no separate digest.
+   CHECK( X509_sign( cert, _key, EVP_PKEY_base_id( _key ) == EVP_PKEY_ED25519 ? nullptr : EVP_sha256() ) > 0 );
+   return cert;
+}
+
+
+static SSL_CTX *make_context( bool _server, EVP_PKEY *_key, X509 *_cert, X509 *_peer, int _tls )
+{
+   SSL_CTX *ctx = SSL_CTX_new( _server ? TLS_server_method() : TLS_client_method() );
+   SSL_CTX_set_min_proto_version( ctx, _tls == 13 ? TLS1_3_VERSION : TLS1_2_VERSION );
+   SSL_CTX_set_max_proto_version( ctx, _tls == 13 ? TLS1_3_VERSION : TLS1_2_VERSION );
+   CHECK( SSL_CTX_use_certificate( ctx, _cert ) == 1 );
+   CHECK( SSL_CTX_use_PrivateKey( ctx, _key ) == 1 );
+   X509_STORE_add_cert( SSL_CTX_get_cert_store( ctx ), _peer );
+   SSL_CTX_set_verify( ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr );
+   // Measure full handshakes only.
+   SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+   SSL_CTX_set_options( ctx, SSL_OP_NO_TICKET );
+   return ctx;
+}
+
+
+static void handshake( SSL_CTX *_server_ctx, SSL_CTX *_client_ctx )
+{
+   SSL *server = SSL_new( _server_ctx );
+   SSL *client = SSL_new( _client_ctx );
+   BIO *server_bio, *client_bio;
+   BIO_new_bio_pair( &server_bio, 0, &client_bio, 0 );
+   SSL_set_bio( server, server_bio, server_bio );
+   SSL_set_bio( client, client_bio, client_bio );
+   SSL_set_accept_state( server );
+   SSL_set_connect_state( client );
+   bool server_done = false, client_done = false;
+   for ( int round = 0; !(server_done && client_done); round++ )
+   {
+      CHECK( round < 100 );
+      int rc = SSL_do_handshake( client );
+      client_done = rc == 1;
+      CHECK( client_done || SSL_get_error( client, rc ) == SSL_ERROR_WANT_READ );
+      rc = SSL_do_handshake( server );
+      server_done = rc == 1;
+      CHECK( server_done || SSL_get_error( server, rc ) == SSL_ERROR_WANT_READ );
+   }
+   SSL_free( client );
+   SSL_free( server );
+}
+
+
+int main( int argc, char *argv[] )
+{
+   int count = argc > 1 ? std::stoi( argv[1] ) : 200;
+   int tls = argc > 2 ? std::stoi( argv[2] ) : 13;
+   std::cout << "Full handshakes with mutual verification, TLS 1." << tls - 10 << ", " << count << " per key type" << std::endl;
+   std::cout << std::setw(10) << "key_type" << std::setw(14) << "handshakes/s" << std::setw(14) << "ms each" << std::endl;
+   try
+   {
+      for ( std::string key_type : { "rsa2048", "rsa3072", "ec-p256", "ed25519" } )
+      {
+         EVP_PKEY *server_key = generate_key( key_type );
+         EVP_PKEY *client_key = generate_key( key_type );
+         X509 *server_cert = generate_certificate( server_key, "server" );
+         X509 *client_cert = generate_certificate( client_key, "client" );
+         SSL_CTX *server_ctx = make_context( true, server_key, server_cert, client_cert, tls );
+         SSL_CTX *client_ctx = make_context( false, client_key, client_cert, server_cert, tls );
+
+         handshake( server_ctx, client_ctx ); // Warm up.
+         auto start = std::chrono::steady_clock::now();
+         for ( int index = 0; index < count; index++ )
+         {
+            handshake( server_ctx, client_ctx );
+         }
+         double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+         std::cout << std::setw(10) << key_type << std::setw(14) << std::fixed << std::setprecision(1) << count / seconds
+                   << std::setw(14) << std::setprecision(3) << seconds * 1000 / count << std::endl;
+
+         SSL_CTX_free( client_ctx );
+         SSL_CTX_free( server_ctx );
+         X509_free( client_cert );
+         X509_free( server_cert );
+         EVP_PKEY_free( client_key );
+         EVP_PKEY_free( server_key );
+      }
+   }
+   catch( std::exception &exc )
+   {
+      std::cerr << "Failed: " << exc.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,122 @@
+//====================================================================
+//
+// Universal Proxy
+//
+// Capture replay
+//--------------------------------------------------------------------
+//
+// This version is released as part of the European Union sponsored
+// project Mona Lisa work package 4 for the Universal Proxy Application
+//
+// This version is released under the GNU General Public License with restrictions.
+// See the doc/license.txt file.
+//
+// Copyright (C) 2011-2019 by GateHouse A/S
+// All Rights Reserved.
+// http://www.gatehouse.dk
+// mailto:gh@gatehouse.dk
+//====================================================================
+//
+// Plays a capture file (see src/capture_format.h) into a local port, e.g. the port of a client or the local
+// endpoint of a host, to reproduce a feed or to load the proxy with real traffic.
+//
+// Usage: uniproxy-replay <capture file> <[host:]port> [speed] [in|out] [loops]
+//
+//    speed  1 for the original rate (default), N for N times faster, 0 for as fast as possible.
+//    in|out The records to play: out (default) is the data that was sent to the peer, in the data received from it.
+//    loops  The number of times to play the file, 0 to play it until stopped.
+//
+#include "capture_format.h"
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using boost::asio::ip::tcp;
+
+
+static void connect_to( tcp::socket &_socket, const std::string &_address )
+{
+   std::string host = "localhost", port = _address;
+   auto pos = _address.rfind( ':' );
+   if ( pos != std::string::npos )
+   {
+      host = _address.substr( 0, pos );
+      port = _address.substr( pos + 1 );
+   }
+   tcp::resolver resolver( _socket.get_executor() );
+   boost::asio::connect( _socket, resolver.resolve( host, port ) );
+}
+
+
+// Returns the number of bytes written.
+static uint64_t play( const std::string &_filename, tcp::socket &_socket, double _speed, capture_format::direction _direction )
+{
+   std::ifstream ifs( _filename, std::ios::binary );
+   std::string peer;
+   if ( !ifs || !capture_format::read_file_header( ifs, peer ) )
+   {
+      throw std::runtime_error( "Not a capture file: " + _filename );
+   }
+   std::cout << "Playing " << _filename << " captured from: " << peer << std::endl;
+   uint64_t bytes = 0, records = 0, first = 0;
+   const auto start = std::chrono::steady_clock::now();
+   capture_format::record record;
+   while ( capture_format::read_record( ifs, record ) )
+   {
+      if ( record.dir != _direction )
+      {
+         continue;
+      }
+      if ( records++ == 0 )
+      {
+         first = record.time;
+      }
+      if ( _speed > 0 )
+      {
+         // The wall clock may have been set back while capturing.
+         const int64_t offset = std::max<int64_t>( (int64_t)(record.time - first), 0 );
+         std::this_thread::sleep_until( start + std::chrono::nanoseconds( (int64_t)(offset / _speed) ) );
+      }
+      boost::asio::write( _socket, boost::asio::buffer( record.data ) );
+      bytes += record.data.size();
+   }
+   const double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+   std::cout << records << " records, " << bytes << " bytes in " << seconds << " s" << std::endl;
+   return bytes;
+}
+
+
+int main( int argc, char *argv[] )
+{
+   if ( argc < 3 )
+   {
+      std::cerr << "Usage: uniproxy-replay <capture file> <[host:]port> [speed] [in|out] [loops]" << std::endl;
+      return 2;
+   }
+   const double speed = argc > 3 ? std::stod( argv[3] ) : 1;
+   const capture_format::direction direction = argc > 4 && std::string( argv[4] ) == "in" ? capture_format::in : capture_format::out;
+   const int loops = argc > 5 ? std::stoi( argv[5] ) : 1;
+   try
+   {
+      boost::asio::io_service io_service;
+      tcp::socket socket( io_service );
+      connect_to( socket, argv[2] );
+      uint64_t bytes = 0;
+      for ( int loop = 0; loops == 0 || loop < loops; loop++ )
+      {
+         bytes += play( argv[1], socket, speed, direction );
+      }
+      std::cout << "Total: " << bytes << " bytes" << std::endl;
+   }
+   catch( std::exception &exc )
+   {
+      std::cerr << "Failed: " << exc.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}